@@ -84,3 +84,76 @@ Examples: images
 | x3f_test_files/_SDI8284.X3F | COLOR_SRGB | x3f_test_files/_SDI8284.X3F.tif | 51455fe0ea00fd9c34ea914ea00e64a0 |
 | x3f_test_files/_SDI8284.X3F | COLOR_ADOBE_RGB | x3f_test_files/_SDI8284.X3F.tif | 949bbb992e2c094f1ae29157e2fa2b19 |
 | x3f_test_files/_SDI8284.X3F | COLOR_PROPHOTO_RGB | x3f_test_files/_SDI8284.X3F.tif | e2ad2a4f11acc30ebe77fa43670a6622 |
+
+
+Scenario Outline: the parsed file structure does not depend on how the file is read
+   Given the X3F file <image>
+    when the structure of <image> is printed after parsing it in bulk and as a stream
+    then the printed structures are the same
+
+Examples: images
+| image |
+| x3f_test_files/_SDI8040.X3F |
+| x3f_test_files/_SDI8284.X3F |
+
+
+Scenario Outline: the RAW data decoded in bands, in part or binned matches a full decode
+   Given the X3F file <image>
+    when the RAW data of <image> is decoded with <options> and checked against a full decode
+    then the RAW data matches the full decode
+
+Examples: images
+| image | options |
+| x3f_test_files/_SDI8040.X3F | -bands 64 |
+| x3f_test_files/_SDI8040.X3F | -bands 100 -planar -release |
+| x3f_test_files/_SDI8040.X3F | -roi 1000 800 2023 1823 |
+| x3f_test_files/_SDI8040.X3F | -roi 1001 801 2024 1824 -planar -release |
+| x3f_test_files/_SDI8040.X3F | -bands 64 -roi 1000 800 2023 1823 |
+| x3f_test_files/_SDI8040.X3F | -bin 3 |
+| x3f_test_files/_SDI8040.X3F | -bin 4 -planar -release |
+| x3f_test_files/_SDI8040.X3F | -bands 64 -roi 1000 800 2023 1823 -bin 2 |
+
+| x3f_test_files/_SDI8284.X3F | -bands 64 |
+| x3f_test_files/_SDI8284.X3F | -bands 100 -planar -release |
+| x3f_test_files/_SDI8284.X3F | -roi 1000 800 2023 1823 |
+| x3f_test_files/_SDI8284.X3F | -roi 1001 801 2024 1824 -planar -release |
+| x3f_test_files/_SDI8284.X3F | -bands 64 -roi 1000 800 2023 1823 |
+| x3f_test_files/_SDI8284.X3F | -bin 3 |
+| x3f_test_files/_SDI8284.X3F | -bin 4 -planar -release |
+| x3f_test_files/_SDI8284.X3F | -bands 64 -roi 1000 800 2023 1823 -bin 2 |
+
+
+Scenario Outline: the RAW data does not depend on how the file is read or the data is kept
+   Given the X3F file <image>
+    when the RAW data of <image> is decoded both as is and with <options>
+    then the RAW data checksums are the same
+
+Examples: images
+| image | options |
+| x3f_test_files/_SDI8040.X3F | -memory |
+| x3f_test_files/_SDI8040.X3F | -stream |
+| x3f_test_files/_SDI8040.X3F | -planar |
+| x3f_test_files/_SDI8040.X3F | -memory -planar |
+| x3f_test_files/_SDI8040.X3F | -release |
+| x3f_test_files/_SDI8040.X3F | -memory -planar -release |
+
+| x3f_test_files/_SDI8284.X3F | -memory |
+| x3f_test_files/_SDI8284.X3F | -stream |
+| x3f_test_files/_SDI8284.X3F | -planar |
+| x3f_test_files/_SDI8284.X3F | -memory -planar |
+| x3f_test_files/_SDI8284.X3F | -release |
+| x3f_test_files/_SDI8284.X3F | -memory -planar -release |
+
+
+Scenario Outline: the RAW data decoded with a saved restart index is the same
+   Given no saved index <index> for the X3F file <image>
+    when the RAW data of <image> is decoded saving the index to <index> and then with <options> loading it
+    then the RAW data checksums are the same
+
+Examples: images
+| image | index | options |
+| x3f_test_files/_SDI8040.X3F | x3f_test_files/_SDI8040.X3F.idx | -release |
+| x3f_test_files/_SDI8040.X3F | x3f_test_files/_SDI8040.X3F.idx | -bands 64 -planar |
+
+| x3f_test_files/_SDI8284.X3F | x3f_test_files/_SDI8284.X3F.idx | -release |
+| x3f_test_files/_SDI8284.X3F | x3f_test_files/_SDI8284.X3F.idx | -bands 64 -planar |
@@ -2,6 +2,7 @@ import hashlib
 import os.path
 import subprocess
 import os
+import re
 import time
 
 
@@ -12,6 +13,12 @@ def get_dist_name():
     return found_executable
 
 
+def get_io_test_name():
+    # x3f_io_test is built next to x3f_extract
+    default = os.path.join(os.path.dirname(get_dist_name()), 'x3f_io_test')
+    return os.getenv('IO_TEST_LOC', default)
+
+
 def run_conversion(args):
     print(args)
     running_proc = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)  # suppressing output
@@ -90,3 +97,76 @@ def step_impl(context, converted_image, md5):
     # however, if these files should always be removed, then remove them immediately after
     # the test should be sufficient.  This should be the last 'then' statement
     # if more tests are later made.
+
+
+@given(u'the X3F file {image}')
+def step_impl(context, image):
+    assert os.path.isfile(image)
+
+
+@when(u'the structure of {image} is printed after parsing it in bulk and as a stream')
+def step_impl(context, image):
+    found_executable = get_io_test_name()
+    context.printed = []
+    for args in ([found_executable, image], [found_executable, '-stream', image]):
+        print(args)
+        output = subprocess.check_output(args).decode('latin-1')
+        # Only the structure matters, not where it was allocated
+        output = output[output.index('PRINT THE SKELETON'):]
+        context.printed.append(re.sub(r'0x[0-9a-f]+|\(nil\)', 'PTR', output))
+
+
+@then(u'the printed structures are the same')
+def step_impl(context):
+    assert context.printed[0] == context.printed[1]
+
+
+def decode_raw(image, options):
+    args = [get_io_test_name(), '-unpack', '-noprint'] + options.split() + [image]
+    print(args)
+    # Fails on a non-zero return code, e.g. for a mismatch
+    return subprocess.check_output(args).decode('latin-1')
+
+
+def raw_checksum(output):
+    found = re.search(r'RAW DATA CHECKSUM ([0-9a-f]+)', output)
+    assert found is not None
+    return found.group(1)
+
+
+@when(u'the RAW data of {image} is decoded with {options} and checked against a full decode')
+def step_impl(context, image, options):
+    context.output = decode_raw(image, options)
+
+
+@then(u'the RAW data matches the full decode')
+def step_impl(context):
+    assert 'RAW DATA MATCHES A FULL DECODE' in context.output
+
+
+@when(u'the RAW data of {image} is decoded both as is and with {options}')
+def step_impl(context, image, options):
+    context.checksums = [raw_checksum(decode_raw(image, '')),
+                         raw_checksum(decode_raw(image, options))]
+
+
+@then(u'the RAW data checksums are the same')
+def step_impl(context):
+    print(context.checksums)
+    assert context.checksums[0] == context.checksums[1]
+
+
+@given(u'no saved index {index} for the X3F file {image}')
+def step_impl(context, index, image):
+    assert os.path.isfile(image)
+    if os.path.isfile(index):
+        os.remove(index)
+
+
+@when(u'the RAW data of {image} is decoded saving the index to {index} and then with {options} loading it')
+def step_impl(context, image, index, options):
+    saved = decode_raw(image, '-save-index ' + index)
+    assert os.path.isfile(index)
+    loaded = decode_raw(image, options + ' -load-index ' + index)
+    os.remove(index)
+    context.checksums = [raw_checksum(saved), raw_checksum(loaded)]
@@ -0,0 +1,101 @@
+/* X3F_BITSTREAM.H
+ *
+ * Reading the bit streams of Huffman coded X3F data.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+/* The bits are read most significant bit first, i.e. bit 7 of a byte
+   is the first bit in the stream. The reader keeps up to 64 bits
+   left adjusted in a buffer, refilled a whole word at a time. Reading
+   beyond the end of the stream yields zero bits. */
+
+#ifndef X3F_BITSTREAM_H
+#define X3F_BITSTREAM_H
+
+#include <inttypes.h>
+
+typedef struct bit_state_s {
+  uint8_t *address;		/* Start of the bit stream */
+  uint8_t *next_address;	/* Next byte to load into buffer */
+  uint8_t *end_address;		/* First byte after the bit stream */
+  uint64_t buffer;		/* Unread bits, left adjusted */
+  uint32_t bits;		/* Number of valid bits in buffer */
+} bit_state_t;
+
+/* Max number of bits that can be peeked after a fill_bits() */
+#define BIT_STATE_MAX_PEEK 56
+
+static inline uint64_t bit_state_get_be64(const uint8_t *p)
+{
+  return
+    ((uint64_t)p[0]<<56) | ((uint64_t)p[1]<<48) |
+    ((uint64_t)p[2]<<40) | ((uint64_t)p[3]<<32) |
+    ((uint64_t)p[4]<<24) | ((uint64_t)p[5]<<16) |
+    ((uint64_t)p[6]<<8)  | ((uint64_t)p[7]<<0);
+}
+
+static inline void set_bit_state(bit_state_t *BS,
+				 uint8_t *address, uint8_t *end)
+{
+  BS->address = address;
+  BS->next_address = address;
+  BS->end_address = end;
+  BS->buffer = 0;
+  BS->bits = 0;
+}
+
+/* Make sure that there are at least BIT_STATE_MAX_PEEK bits in the
+   buffer. NOTE: the word load may OR in the first bits of the next
+   byte ahead of time. That is harmless, as the very same bits end up
+   in the very same place when that byte is loaded for real. */
+static inline void fill_bits(bit_state_t *BS)
+{
+  if (BS->end_address - BS->next_address >= 8) {
+    BS->buffer |= bit_state_get_be64(BS->next_address) >> BS->bits;
+    BS->next_address += (63 - BS->bits) >> 3;
+    BS->bits |= 56;
+  } else {
+    while (BS->bits <= 56) {
+      if (BS->next_address < BS->end_address)
+	BS->buffer |= (uint64_t)*BS->next_address++ << (56 - BS->bits);
+      BS->bits += 8;
+    }
+  }
+}
+
+/* Look at the next n (1 <= n <= BIT_STATE_MAX_PEEK) bits without
+   consuming them. There must be enough bits in the buffer. */
+static inline uint32_t peek_bits(bit_state_t *BS, int n)
+{
+  return (uint32_t)(BS->buffer >> (64 - n));
+}
+
+static inline void consume_bits(bit_state_t *BS, int n)
+{
+  BS->buffer <<= n;
+  BS->bits -= n;
+}
+
+static inline uint8_t get_bit(bit_state_t *BS)
+{
+  uint8_t bit;
+
+  if (BS->bits == 0) fill_bits(BS);
+
+  bit = (uint8_t)(BS->buffer >> 63);
+  consume_bits(BS, 1);
+
+  return bit;
+}
+
+/* Number of bits consumed since set_bit_state(), as long as the end
+   of the stream has not been passed */
+static inline uint64_t get_bit_pos(bit_state_t *BS)
+{
+  return (uint64_t)(BS->next_address - BS->address)*8 - BS->bits;
+}
+
+#endif
@@ -0,0 +1,121 @@
+/* X3F_BITSTREAM_BENCH.C
+ *
+ * Micro benchmark of the bit stream reader.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_bitstream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* The reader used before x3f_bitstream.h, unpacking every byte into
+   an array and returning one bit per call. Kept here as reference. */
+
+typedef struct legacy_bit_state_s {
+  uint8_t *next_address;
+  uint8_t bit_offset;
+  uint8_t bits[8];
+} legacy_bit_state_t;
+
+static void legacy_set_bit_state(legacy_bit_state_t *BS, uint8_t *address)
+{
+  BS->next_address = address;
+  BS->bit_offset = 8;
+}
+
+static uint8_t legacy_get_bit(legacy_bit_state_t *BS)
+{
+  if (BS->bit_offset == 8) {
+    uint8_t byte = *BS->next_address;
+    int i;
+
+    for (i=7; i>= 0; i--) {
+      BS->bits[i] = byte&1;
+      byte = byte >> 1;
+    }
+    BS->next_address++;
+    BS->bit_offset = 0;
+  }
+
+  return BS->bits[BS->bit_offset++];
+}
+
+static double seconds(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void report(char *name, uint64_t bits, double secs, uint64_t sum)
+{
+  printf("%-28s %8.1f Mbit/s (checksum %016" PRIx64 ")\n",
+	 name, secs > 0.0 ? bits / secs / 1e6 : 0.0, sum);
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t mbytes = argc > 1 ? atoi(argv[1]) : 16;
+  uint32_t size = mbytes * 1024 * 1024;
+  uint64_t nbits = (uint64_t)size * 8;
+  uint8_t *data = (uint8_t *)malloc(size);
+  uint32_t seed = 4711;
+  uint64_t i, sum_legacy, sum_single, sum_multi;
+  legacy_bit_state_t LBS;
+  bit_state_t BS;
+  clock_t start;
+
+  if (data == NULL || size == 0) {
+    fprintf(stderr, "usage: %s [<MB>]\n", argv[0]);
+    return 1;
+  }
+
+  for (i=0; i<size; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (uint8_t)(seed >> 16);
+  }
+
+  printf("Reading %u MB of bits\n", mbytes);
+
+  /* Before: one bit per call */
+  legacy_set_bit_state(&LBS, data);
+  sum_legacy = 0;
+  start = clock();
+  for (i=0; i<nbits; i++)
+    sum_legacy = sum_legacy * 3 + legacy_get_bit(&LBS);
+  report("legacy get_bit", nbits, seconds(start), sum_legacy);
+
+  /* After: one bit per call */
+  set_bit_state(&BS, data, data + size);
+  sum_single = 0;
+  start = clock();
+  for (i=0; i<nbits; i++)
+    sum_single = sum_single * 3 + get_bit(&BS);
+  report("get_bit", nbits, seconds(start), sum_single);
+
+  /* After: variable length fields, as when decoding with tables */
+  set_bit_state(&BS, data, data + size);
+  sum_multi = 0;
+  start = clock();
+  for (i=0; i + 32 <= nbits; ) {
+    int n = 1 + (i & 15);
+
+    fill_bits(&BS);
+    sum_multi += peek_bits(&BS, n);
+    consume_bits(&BS, n);
+    i += n;
+  }
+  report("fill/peek/consume_bits", i, seconds(start), sum_multi);
+
+  free(data);
+
+  if (sum_legacy != sum_single) {
+    fprintf(stderr, "Bit readers disagree\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -18,6 +18,7 @@
 #include "x3f_print_meta.h"
 #include "x3f_dump.h"
 #include "x3f_denoise.h"
+#include "x3f_parallel.h"
 #include "x3f_printf.h"
 
 #include <stdio.h>
@@ -79,6 +80,14 @@ static void usage(char *progname)
           "   -wb <WB>        Select white balance preset\n"
           "   -compress       Enable ZIP compression for DNG and TIFF output\n"
           "   -ocl            Use OpenCL\n"
+          "   -threads <N>    Use at most <N> threads for decoding\n"
+          "                   NOTE: If not given, or 0, then all cores are used\n"
+          "   -true-index     Keep an index of the RAW data in <file>.tidx\n"
+          "                   NOTE: Makes decoding the same file again faster\n"
+          "   -bin <N>        Decode RAW at 1/<N> of the size, in <N>x<N> bins\n"
+          "                   NOTE: Only with -unprocessed or -qtop, no crop\n"
+          "   -planar         Keep the colors of RAW data in separate planes\n"
+          "                   while preprocessing\n"
 	  "\n"
 	  "STRANGE STUFF\n"
           "   -offset <OFF>   Offset for SD14 and older\n"
@@ -190,6 +199,10 @@ int main(int argc, char *argv[])
   char *wb = NULL;
   int compress = 0;
   int use_opencl = 0;
+  int max_threads = 0;
+  int true_index = 0;
+  int bin = 1;
+  int planar = 0;
   char *outdir = NULL;
   x3f_return_t ret;
 
@@ -264,6 +277,14 @@ int main(int argc, char *argv[])
       compress = 1;
     else if (!strcmp(argv[i], "-ocl"))
       use_opencl = 1;
+    else if ((!strcmp(argv[i], "-threads")) && (i+1)<argc)
+      max_threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-true-index"))
+      true_index = 1;
+    else if ((!strcmp(argv[i], "-bin")) && (i+1)<argc)
+      bin = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-planar"))
+      planar = 1;
 
   /* Strange Stuff */
     else if ((!strcmp(argv[i], "-offset")) && (i+1)<argc)
@@ -280,7 +301,22 @@ int main(int argc, char *argv[])
     usage(argv[0]);
   }
 
+  /* The binned image does not match the areas in CAMF, so it can
+     neither be cropped nor processed */
+  if (bin < 1 ||
+      (bin > 1 &&
+       (!extract_raw || file_type == DNG ||
+	(color_encoding != UNPROCESSED && color_encoding != QTOP)))) {
+    x3f_printf(ERR, "Binning needs -unprocessed or -qtop\n");
+    usage(argv[0]);
+  }
+  if (bin > 1) crop = 0;
+
   x3f_set_use_opencl(use_opencl);
+  x3f_set_max_threads(max_threads);
+  x3f_set_use_planar(planar);
+  /* The compressed RAW data is never used once decoded */
+  x3f_set_release_data(1);
 
   extract_meta =
     file_type == META ||
@@ -341,17 +377,35 @@ int main(int argc, char *argv[])
 
     if (extract_raw) {
       x3f_directory_entry_t *DE;
+      char idxfile[MAXOUTPATH+1];
+      int loaded_index = 0;
 
       if (NULL == (DE = x3f_get_raw(x3f))) {
 	x3f_printf(ERR, "Could not find any matching RAW format\n");
 	goto found_error;
       }
 
-      if (X3F_OK != (ret = x3f_load_data(x3f, DE))) {
+      if (true_index) {
+	if (safecpy(idxfile, infile, MAXOUTPATH) ||
+	    safecat(idxfile, ".tidx", MAXOUTPATH)) {
+	  x3f_printf(ERR, "Too large index path for infile %s\n", infile);
+	  goto found_error;
+	}
+	loaded_index = X3F_OK == x3f_load_true_index(x3f, idxfile);
+      }
+
+      if (X3F_OK != (ret = bin > 1 ?
+		     x3f_load_data_binned(x3f, DE, bin) :
+		     x3f_load_data(x3f, DE))) {
 	x3f_printf(ERR, "Could not load RAW from %s (%s)\n",
 		   infile, x3f_err(ret));
 	goto found_error;
       }
+
+      /* Fails silently for RAW formats without index */
+      if (true_index && !loaded_index &&
+	  X3F_OK == x3f_save_true_index(x3f, idxfile))
+	x3f_printf(DEBUG, "Saved TRUE index to %s\n", idxfile);
     }
 
     if (extract_unconverted_raw) {
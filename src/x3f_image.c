@@ -13,6 +13,7 @@
 #include "x3f_printf.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
 /* extern */ int x3f_image_area(x3f_t *x3f, x3f_area16_t *image)
@@ -64,6 +65,100 @@
   return 1;
 }
 
+/* Get the planes of a RAW image loaded in planar layout */
+
+/* extern */ int x3f_image_planes(x3f_t *x3f, x3f_area16_t *planes)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_image_data_t *ID;
+  x3f_area16_t *plane = NULL;
+  int color;
+
+  if (!DE) return 0;
+
+  ID = &DE->header.data_subsection.image_data;
+  if (!ID->planar) return 0;
+
+  if (ID->huffman != NULL)
+    plane = ID->huffman->plane16;
+
+  if (ID->tru != NULL)
+    plane = ID->tru->plane16;
+
+  if (!plane || !plane[0].data) return 0;
+
+  for (color = 0; color < 3; color++) {
+    planes[color] = plane[color];
+    planes[color].buf = NULL;	/* cleanup_true/cleanup_huffman is
+				   responsible for free() */
+  }
+
+  return 1;
+}
+
+/* Convert a RAW image loaded in planar layout to the interleaved
+   layout, for the stages that need it. Nothing is done if it already
+   is interleaved. */
+
+/* extern */ int x3f_image_interleave(x3f_t *x3f)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_image_data_t *ID;
+  x3f_area16_t planes[3], *area = NULL, *plane = NULL;
+  int row, col, color;
+
+  if (!x3f_image_planes(x3f, planes)) return 1;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  if (ID->huffman != NULL)
+    area = &ID->huffman->x3rgb16, plane = ID->huffman->plane16;
+
+  if (ID->tru != NULL)
+    area = &ID->tru->x3rgb16, plane = ID->tru->plane16;
+
+  area->columns = planes[0].columns;
+  area->rows = planes[0].rows;
+  area->channels = 3;
+  area->row_stride = area->columns*area->channels;
+  area->data = area->buf =
+    malloc(area->rows*area->row_stride*sizeof(uint16_t));
+  if (!area->data) return 0;
+
+  for (row = 0; row < area->rows; row++)
+    for (color = 0; color < 3; color++) {
+      uint16_t *src = &planes[color].data[planes[color].row_stride*row];
+      uint16_t *dst = &area->data[area->row_stride*row + color];
+
+      for (col = 0; col < area->columns; col++)
+	dst[area->channels*col] = src[col];
+    }
+
+  free(plane[0].buf);
+  for (color = 0; color < 3; color++) {
+    plane[color].data = NULL;
+    plane[color].buf = NULL;
+  }
+  ID->planar = 0;
+
+  return 1;
+}
+
+/* Split image into one area per channel, without copying. NOTE: in
+   each of those, channels is the distance between two columns, but
+   there is only one color. For planes it is 1. */
+
+/* extern */ void x3f_image_channels(x3f_area16_t *image,
+				     x3f_area16_t *channels)
+{
+  int color;
+
+  for (color = 0; color < image->channels; color++) {
+    channels[color] = *image;
+    channels[color].data = image->data + color;
+  }
+}
+
 /* extern */ int x3f_crop_area(uint32_t *coord, x3f_area16_t *image,
 			       x3f_area16_t *crop)
 {
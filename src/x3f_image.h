@@ -18,6 +18,9 @@ typedef enum {COL_SIDE_LEFT = 0,
 
 extern int x3f_image_area(x3f_t *x3f, x3f_area16_t *image);
 extern int x3f_image_area_qtop(x3f_t *x3f, x3f_area16_t *image);
+extern int x3f_image_planes(x3f_t *x3f, x3f_area16_t *planes);
+extern int x3f_image_interleave(x3f_t *x3f);
+extern void x3f_image_channels(x3f_area16_t *image, x3f_area16_t *channels);
 extern int x3f_crop_area(uint32_t *coord, x3f_area16_t *image,
 			 x3f_area16_t *crop);
 extern int x3f_crop_area8(uint32_t *coord, x3f_area8_t *image,
@@ -8,17 +8,33 @@
  */
 
 #include "x3f_io.h"
+#include "x3f_bitstream.h"
+#include "x3f_parallel.h"
 #include "x3f_printf.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMPLE_DECODE_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #if defined(_WIN32) || defined (_WIN64)
 #include <windows.h>
 #else
 #include <iconv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define X3F_USE_MMAP
 #endif
 
 /* --------------------------------------------------------------------- */
@@ -41,26 +57,108 @@
 /* Reading and writing - assuming little endian in the file              */
 /* --------------------------------------------------------------------- */
 
-static int x3f_get1(FILE *f)
+/* The input is either a file or a buffer in memory */
+
+static int input_getc(x3f_info_t *I)
+{
+  if (I->input.file != NULL)
+    return getc(I->input.file);
+
+  if (I->memory.pos >= I->memory.size)
+    return EOF;
+
+  return I->memory.data[I->memory.pos++];
+}
+
+static size_t input_fread(void *ptr, size_t size, size_t nmemb,
+			  x3f_info_t *I)
+{
+  size_t n;
+
+  if (I->input.file != NULL)
+    return fread(ptr, size, nmemb, I->input.file);
+
+  if (I->memory.pos >= I->memory.size)
+    return 0;
+
+  n = (I->memory.size - I->memory.pos) / size;
+  if (n > nmemb) n = nmemb;
+  memcpy(ptr, I->memory.data + I->memory.pos, n*size);
+  I->memory.pos += n*size;
+
+  return n;
+}
+
+static int input_seek(x3f_info_t *I, long offset, int whence)
+{
+  if (I->input.file != NULL)
+    return fseek(I->input.file, offset, whence);
+
+  switch (whence) {
+  case SEEK_CUR:
+    offset += I->memory.pos;
+    break;
+  case SEEK_END:
+    offset += I->memory.size;
+    break;
+  }
+
+  if (offset < 0)
+    return -1;
+
+  I->memory.pos = offset;
+
+  return 0;
+}
+
+static long input_tell(x3f_info_t *I)
+{
+  if (I->input.file != NULL)
+    return ftell(I->input.file);
+
+  return I->memory.pos;
+}
+
+static int x3f_get1(x3f_info_t *I)
 {
   /* Little endian file */
-  return getc(f);
+  return input_getc(I);
 }
 
-static int x3f_get2(FILE *f)
+static int x3f_get2(x3f_info_t *I)
 {
   /* Little endian file */
-  return (getc(f)<<0) + (getc(f)<<8);
+  return (input_getc(I)<<0) + (input_getc(I)<<8);
 }
 
-static int x3f_get4(FILE *f)
+static int x3f_get4(x3f_info_t *I)
 {
   /* Little endian file */
-  return (getc(f)<<0) + (getc(f)<<8) + (getc(f)<<16) + (getc(f)<<24);
+  return
+    (input_getc(I)<<0) + (input_getc(I)<<8) +
+    (input_getc(I)<<16) + (input_getc(I)<<24);
 }
 
 #define FREE(P) do { free(P); (P) = NULL; } while (0)
 
+/* Whether p points into the input held in memory */
+static int in_input(x3f_info_t *I, void *p)
+{
+  uintptr_t start = (uintptr_t)I->memory.data;
+
+  return
+    I->memory.data != NULL &&
+    (uintptr_t)p >= start && (uintptr_t)p < start + I->memory.size;
+}
+
+/* Data blocks that point into the input held in memory are not
+   owned. The others were read into memory of their own. */
+#define FREE_DATA(I,P)				\
+  do {						\
+    if (!in_input((I), (P))) free(P);		\
+    (P) = NULL;					\
+  } while (0)
+
 #define PUT_GET_N(_buffer,_size,_file,_func)			\
   do								\
     {								\
@@ -75,23 +173,23 @@ static int x3f_get4(FILE *f)
       }								\
     } while(0)
 
-#define GET1(_v) do {(_v) = x3f_get1(I->input.file);} while (0)
-#define GET2(_v) do {(_v) = x3f_get2(I->input.file);} while (0)
-#define GET4(_v) do {(_v) = x3f_get4(I->input.file);} while (0)
+#define GET1(_v) do {(_v) = x3f_get1(I);} while (0)
+#define GET2(_v) do {(_v) = x3f_get2(I);} while (0)
+#define GET4(_v) do {(_v) = x3f_get4(I);} while (0)
 #define GET4F(_v)				\
   do {						\
     union {int32_t i; float f;} _tmp;		\
-    _tmp.i = x3f_get4(I->input.file);		\
+    _tmp.i = x3f_get4(I);			\
     (_v) = _tmp.f;				\
   } while (0)
-#define GETN(_v,_s) PUT_GET_N(_v,_s,I->input.file,fread)
+#define GETN(_v,_s) PUT_GET_N(_v,_s,I,input_fread)
 
 #define GET_TABLE(_T, _GETX, _NUM)					\
   do {									\
     int _i;								\
     (_T).size = (_NUM);							\
-    (_T).element = (void *)realloc((_T).element,			\
-				   (_NUM)*sizeof((_T).element[0]));	\
+    (_T).element = (void *)arena_alloc(&I->arena,			\
+				       (_NUM)*sizeof((_T).element[0])); \
     for (_i = 0; _i < (_T).size; _i++)					\
       _GETX((_T).element[_i]);						\
   } while (0)
@@ -100,28 +198,126 @@ static int x3f_get4(FILE *f)
   do {									\
     int _i;								\
     (_T).size = (_NUM);							\
-    (_T).element = (void *)realloc((_T).element,			\
-				   (_NUM)*sizeof((_T).element[0]));	\
+    (_T).element = (void *)arena_alloc(&I->arena,			\
+				       (_NUM)*sizeof((_T).element[0])); \
     for (_i = 0; _i < (_T).size; _i++) {				\
       GET4((_T).element[_i].name_offset);				\
       GET4((_T).element[_i].value_offset);				\
     }									\
   } while (0)
 
+/* The table ends with a zero code size, so its size is not known in
+   advance. It is grown by doubling, leaving the old copies in the
+   arena, which is cheap as the tables are small. */
 #define GET_TRUE_HUFF_TABLE(_T)						\
   do {									\
-    int _i;								\
-    (_T).element = NULL;						\
+    int _i, _n = 16;							\
+    (_T).element = (void *)arena_alloc(&I->arena,			\
+				       _n*sizeof((_T).element[0]));	\
     for (_i = 0; ; _i++) {						\
+      if (_i == _n) {							\
+	void *_old = (_T).element;					\
+	_n *= 2;							\
+	(_T).element = (void *)arena_alloc(&I->arena,			\
+					   _n*sizeof((_T).element[0])); \
+	memcpy((_T).element, _old, _i*sizeof((_T).element[0]));	\
+      }									\
       (_T).size = _i + 1;						\
-      (_T).element = (void *)realloc((_T).element,			\
-				     (_i + 1)*sizeof((_T).element[0]));	\
       GET1((_T).element[_i].code_size);					\
       GET1((_T).element[_i].code);					\
       if ((_T).element[_i].code_size == 0) break;			\
     }									\
   } while (0)
 
+/* --------------------------------------------------------------------- */
+/* Arena for the tables of a file                                        */
+/* --------------------------------------------------------------------- */
+
+/* The directory, code tables, property tables, CAMF entries and the
+   like are many and small, and live as long as the file. They are
+   carved out of big blocks owned by the x3f_t, and all freed together
+   by x3f_delete(). Image data, pixel buffers, decoded CAMF data and
+   the trees and lookup tables that may be shared between files are
+   allocated on their own. Memory from the arena is zeroed. */
+
+#define ARENA_BLOCK_SIZE (16*1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(_s) (((_s) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct x3f_arena_block_s {
+  struct x3f_arena_block_s *next;
+  size_t size;			/* Bytes of data */
+  size_t used;
+} x3f_arena_block_t;
+
+#define ARENA_DATA(_b) ((uint8_t *)(_b) + ARENA_ROUND(sizeof(x3f_arena_block_t)))
+
+static void *arena_alloc(x3f_arena_t *A, size_t size)
+{
+  x3f_arena_block_t *B = A->block;
+  void *p;
+
+  size = ARENA_ROUND(size);
+  if (size == 0) return NULL;
+
+  if (B == NULL || B->size - B->used < size) {
+    /* Big allocations get a block of their own, which is put behind
+       the current one so that its free space is still used */
+    size_t block_size = size > ARENA_BLOCK_SIZE/4 ? size : ARENA_BLOCK_SIZE;
+    x3f_arena_block_t *N = (x3f_arena_block_t *)
+      calloc(1, ARENA_ROUND(sizeof(x3f_arena_block_t)) + block_size);
+
+    N->size = block_size;
+    N->used = 0;
+
+    if (B != NULL && block_size != ARENA_BLOCK_SIZE) {
+      N->next = B->next;
+      B->next = N;
+    } else {
+      N->next = B;
+      A->block = N;
+    }
+
+    A->size += block_size;
+    B = N;
+  }
+
+  p = ARENA_DATA(B) + B->used;
+  B->used += size;
+  A->used += size;
+
+  return p;
+}
+
+/* Give back the end of the latest allocation, if it is still the
+   latest one */
+static void arena_shrink(x3f_arena_t *A, void *p, size_t size,
+			 size_t new_size)
+{
+  x3f_arena_block_t *B = A->block;
+  size_t give_back = ARENA_ROUND(size) - ARENA_ROUND(new_size);
+
+  if (B == NULL || ARENA_DATA(B) + B->used != (uint8_t *)p + ARENA_ROUND(size))
+    return;
+
+  memset((uint8_t *)p + ARENA_ROUND(new_size), 0, give_back);
+  B->used -= give_back;
+  A->used -= give_back;
+}
+
+static void arena_free(x3f_arena_t *A)
+{
+  while (A->block != NULL) {
+    x3f_arena_block_t *next = A->block->next;
+
+    free(A->block);
+    A->block = next;
+  }
+
+  A->size = 0;
+  A->used = 0;
+}
+
 /* --------------------------------------------------------------------- */
 /* Allocating Huffman tree help data                                   */
 /* --------------------------------------------------------------------- */
@@ -131,13 +327,342 @@ static void cleanup_huffman_tree(x3f_hufftree_t *HTP)
   free(HTP->nodes);
 }
 
+/* Room for the worst case while building, trimmed when done */
 static void new_huffman_tree(x3f_hufftree_t *HTP, int bits)
 {
   int leaves = 1<<bits;
 
+  assert(HUF_TREE_MAX_NODES(leaves) <= 0x10000);
+
   HTP->free_node_index = 0;
+  HTP->total_node_count = HUF_TREE_MAX_NODES(leaves);
   HTP->nodes = (x3f_huffnode_t *)
-    calloc(1, HUF_TREE_MAX_NODES(leaves)*sizeof(x3f_huffnode_t));
+    calloc(1, HTP->total_node_count*sizeof(x3f_huffnode_t));
+}
+
+static void cleanup_huff_lut(x3f_huff_lut_t *LUT)
+{
+  free(LUT->entry);
+}
+
+/* Append a zeroed table with 1<<bits entries, returning its start */
+static uint32_t new_huff_lut_table(x3f_huff_lut_t *LUT, int bits)
+{
+  uint32_t start = LUT->size;
+  uint32_t n = 1<<bits;
+
+  LUT->size += n;
+  LUT->entry = (x3f_huff_lut_entry_t *)
+    realloc(LUT->entry, LUT->size*sizeof(x3f_huff_lut_entry_t));
+  memset(&LUT->entry[start], 0, n*sizeof(x3f_huff_lut_entry_t));
+
+  return start;
+}
+
+static void cleanup_true_lut(x3f_true_lut_t *LUT)
+{
+  free(LUT->entry);
+}
+
+static void new_true_lut(x3f_true_lut_t *LUT)
+{
+  LUT->entry = (x3f_true_lut_entry_t *)
+    calloc(1<<X3F_TRUE_LUT_BITS, sizeof(x3f_true_lut_entry_t));
+}
+
+/* --------------------------------------------------------------------- */
+/* Indexes of names                                                      */
+/* --------------------------------------------------------------------- */
+
+/* The metadata is looked up by name, many times per conversion, so
+   the CAMF entries, CAMF property lists and PROP entries get an
+   index each when they are loaded. An index is generic over the
+   table, which is given by the stride between its elements and the
+   offset of the name pointer in them. With duplicate names, the
+   first one in the table is found, as with a linear search. */
+
+#define INDEXED_NAME(_table, _stride, _offset, _i)			\
+  (*(char **)((uint8_t *)(_table) + (size_t)(_i)*(_stride) + (_offset)))
+
+static uint32_t name_hash(char *name)
+{
+  uint32_t h = 2166136261u;
+
+  while (*name)
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+
+  return h;
+}
+
+static void new_name_index(x3f_arena_t *A, x3f_name_index_t *index,
+			   void *table, size_t stride, size_t name_offset,
+			   uint32_t num)
+{
+  uint32_t size = 1;
+  uint32_t i;
+
+  index->size = 0;
+  index->slot = NULL;
+
+  if (num == 0) return;
+
+  /* At most half full */
+  while (size < 2*num) size <<= 1;
+
+  index->size = size;
+  index->slot = (uint32_t *)arena_alloc(A, size*sizeof(uint32_t));
+
+  for (i=0; i<num; i++) {
+    char *name = INDEXED_NAME(table, stride, name_offset, i);
+    uint32_t s;
+
+    if (name == NULL) continue;
+
+    for (s = name_hash(name) & (size-1);
+	 index->slot[s] != 0;
+	 s = (s+1) & (size-1));
+
+    index->slot[s] = i + 1;
+  }
+}
+
+static int32_t find_name(x3f_name_index_t *index, void *table,
+			 size_t stride, size_t name_offset, char *name)
+{
+  uint32_t s;
+
+  if (index->slot == NULL) return -1;
+
+  for (s = name_hash(name) & (index->size-1);
+       index->slot[s] != 0;
+       s = (s+1) & (index->size-1)) {
+    uint32_t i = index->slot[s] - 1;
+
+    if (!strcmp(name, INDEXED_NAME(table, stride, name_offset, i)))
+      return i;
+  }
+
+  return -1;
+}
+
+/* extern */ camf_entry_t *x3f_find_camf_entry(x3f_camf_t *CAMF, char *name)
+{
+  int32_t i = find_name(&CAMF->entry_index, CAMF->entry_table.element,
+			sizeof(camf_entry_t),
+			offsetof(camf_entry_t, name_address), name);
+
+  return i < 0 ? NULL : &CAMF->entry_table.element[i];
+}
+
+/* Get the index of the property in a CAMF property list, or -1 */
+
+/* extern */ int32_t x3f_find_camf_property(camf_entry_t *entry, char *name)
+{
+  return find_name(&entry->property_index, entry->property_name,
+		   sizeof(char *), 0, name);
+}
+
+/* extern */ x3f_property_t *x3f_find_property(x3f_property_list_t *PL,
+					       char *name)
+{
+  int32_t i = find_name(&PL->property_index, PL->property_table.element,
+			sizeof(x3f_property_t),
+			offsetof(x3f_property_t, name_utf8), name);
+
+  return i < 0 ? NULL : &PL->property_table.element[i];
+}
+
+/* --------------------------------------------------------------------- */
+/* Cache of Huffman trees and lookup tables                              */
+/* --------------------------------------------------------------------- */
+
+/* Files from the same camera have the same code tables, so the trees
+   and lookup tables built from them are kept, and shared between the
+   files and threads using them. The key is the code table itself,
+   compared in full, so a hash collision is harmless. The cache is
+   bounded, and only entries not in use are evicted. */
+
+#define TABLE_CACHE_SIZE 8
+
+typedef enum {
+  TABLE_CACHE_FREE = 0,
+  TABLE_CACHE_TRUE,
+  TABLE_CACHE_HUFFMAN
+} table_cache_kind_t;
+
+typedef struct x3f_cached_tables_s {
+  table_cache_kind_t kind;
+  uint64_t hash;
+  uint8_t *key;
+  size_t key_size;
+  x3f_hufftree_t tree;
+  x3f_true_lut_t true_lut;
+  x3f_huff_lut_t huff_lut;
+  uint32_t users;
+  uint64_t last_use;
+} x3f_cached_tables_t;
+
+static x3f_cached_tables_t table_cache[TABLE_CACHE_SIZE];
+static uint64_t table_cache_clock = 0;
+
+static int use_table_cache = 1;
+
+/* extern */ void x3f_set_use_table_cache(int flag)
+{
+  use_table_cache = flag;
+}
+
+static uint64_t table_cache_hash(uint8_t *key, size_t key_size)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+  size_t i;
+
+  for (i=0; i<key_size; i++) {
+    hash ^= key[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static void table_cache_free(x3f_cached_tables_t *C)
+{
+  cleanup_huffman_tree(&C->tree);
+  cleanup_true_lut(&C->true_lut);
+  cleanup_huff_lut(&C->huff_lut);
+  free(C->key);
+  memset(C, 0, sizeof(x3f_cached_tables_t));
+}
+
+/* Shall be called with the lock held */
+static x3f_cached_tables_t *table_cache_find(table_cache_kind_t kind,
+					     uint64_t hash,
+					     uint8_t *key, size_t key_size)
+{
+  int i;
+
+  for (i=0; i<TABLE_CACHE_SIZE; i++) {
+    x3f_cached_tables_t *C = &table_cache[i];
+
+    if (C->kind == kind && C->hash == hash && C->key_size == key_size &&
+	!memcmp(C->key, key, key_size)) {
+      C->users++;
+      C->last_use = ++table_cache_clock;
+      return C;
+    }
+  }
+
+  return NULL;
+}
+
+/* Get the tables built from key, or NULL if not cached */
+static x3f_cached_tables_t *table_cache_get(table_cache_kind_t kind,
+					    uint8_t *key, size_t key_size)
+{
+  uint64_t hash = table_cache_hash(key, key_size);
+  x3f_cached_tables_t *C;
+
+  if (!use_table_cache) return NULL;
+
+  x3f_parallel_lock();
+  C = table_cache_find(kind, hash, key, key_size);
+  x3f_parallel_unlock();
+
+  if (C != NULL)
+    x3f_printf(DEBUG, "Found cached Huffman tables\n");
+
+  return C;
+}
+
+/* Hand over the tables just built from key to the cache. They are
+   freed if another thread has cached the same in the meantime. NULL
+   is returned, and the tables are still owned by the caller, if
+   there is no room. */
+static x3f_cached_tables_t *table_cache_put(table_cache_kind_t kind,
+					    uint8_t *key, size_t key_size,
+					    x3f_hufftree_t *tree,
+					    x3f_true_lut_t *true_lut,
+					    x3f_huff_lut_t *huff_lut)
+{
+  uint64_t hash = table_cache_hash(key, key_size);
+  x3f_cached_tables_t *C, *victim = NULL;
+  int i;
+
+  if (!use_table_cache) return NULL;
+
+  x3f_parallel_lock();
+
+  C = table_cache_find(kind, hash, key, key_size);
+
+  if (C == NULL) {
+    /* A free entry, or else the least recently used one not in use */
+    for (i=0; i<TABLE_CACHE_SIZE; i++) {
+      x3f_cached_tables_t *E = &table_cache[i];
+
+      if (E->users != 0) continue;
+      if (E->kind == TABLE_CACHE_FREE) {
+	victim = E;
+	break;
+      }
+      if (victim == NULL || E->last_use < victim->last_use)
+	victim = E;
+    }
+
+    if (victim != NULL) {
+      uint8_t *key_copy = (uint8_t *)malloc(key_size);
+
+      if (key_copy != NULL) {
+	C = victim;
+	table_cache_free(C);
+
+	memcpy(key_copy, key, key_size);
+	C->kind = kind;
+	C->hash = hash;
+	C->key = key_copy;
+	C->key_size = key_size;
+	if (tree != NULL) C->tree = *tree;
+	if (true_lut != NULL) C->true_lut = *true_lut;
+	if (huff_lut != NULL) C->huff_lut = *huff_lut;
+	C->users = 1;
+	C->last_use = ++table_cache_clock;
+
+	tree = NULL;
+	true_lut = NULL;
+	huff_lut = NULL;
+      }
+    }
+  }
+
+  x3f_parallel_unlock();
+
+  /* Lost the race, use the tables already cached */
+  if (C != NULL) {
+    if (tree != NULL) cleanup_huffman_tree(tree);
+    if (true_lut != NULL) cleanup_true_lut(true_lut);
+    if (huff_lut != NULL) cleanup_huff_lut(huff_lut);
+  }
+
+  return C;
+}
+
+static void table_cache_release(x3f_cached_tables_t *C)
+{
+  x3f_parallel_lock();
+  C->users--;
+  x3f_parallel_unlock();
+}
+
+/* Free all cached tables not in use */
+
+/* extern */ void x3f_clear_table_cache(void)
+{
+  int i;
+
+  x3f_parallel_lock();
+  for (i=0; i<TABLE_CACHE_SIZE; i++)
+    if (table_cache[i].kind != TABLE_CACHE_FREE && table_cache[i].users == 0)
+      table_cache_free(&table_cache[i]);
+  x3f_parallel_unlock();
 }
 
 /* --------------------------------------------------------------------- */
@@ -152,10 +677,14 @@ static void cleanup_true(x3f_true_t **TRUP)
 
   x3f_printf(DEBUG, "Cleanup TRUE data\n");
 
-  FREE(TRU->table.element);
-  FREE(TRU->plane_size.element);
-  cleanup_huffman_tree(&TRU->tree);
+  if (TRU->cached != NULL)
+    table_cache_release(TRU->cached);
+  else {
+    cleanup_huffman_tree(&TRU->tree);
+    cleanup_true_lut(&TRU->lut);
+  }
   FREE(TRU->x3rgb16.buf);
+  FREE(TRU->plane16[0].buf);
 
   FREE(TRU);
 
@@ -173,6 +702,8 @@ static x3f_true_t *new_true(x3f_true_t **TRUP)
   TRU->plane_size.size = 0;
   TRU->plane_size.element = NULL;
   TRU->tree.nodes = NULL;
+  TRU->lut.entry = NULL;
+  TRU->cached = NULL;
   TRU->x3rgb16.data = NULL;
   TRU->x3rgb16.buf = NULL;
 
@@ -181,6 +712,20 @@ static x3f_true_t *new_true(x3f_true_t **TRUP)
   return TRU;
 }
 
+static void cleanup_true_index(x3f_true_index_t **indexp)
+{
+  x3f_true_index_t *index = *indexp;
+  int color;
+
+  if (index == NULL) return;
+
+  for (color = 0; color < TRUE_PLANES; color++)
+    FREE(index->plane[color].element);
+  FREE(index);
+
+  *indexp = NULL;
+}
+
 static void cleanup_quattro(x3f_quattro_t **QP)
 {
   x3f_quattro_t *Q = *QP;
@@ -229,12 +774,15 @@ static void cleanup_huffman(x3f_huffman_t **HUFP)
 
   x3f_printf(DEBUG, "Cleanup Huffman\n");
 
-  FREE(HUF->mapping.element);
-  FREE(HUF->table.element);
-  cleanup_huffman_tree(&HUF->tree);
-  FREE(HUF->row_offsets.element);
+  if (HUF->cached != NULL)
+    table_cache_release(HUF->cached);
+  else {
+    cleanup_huffman_tree(&HUF->tree);
+    cleanup_huff_lut(&HUF->lut);
+  }
   FREE(HUF->rgb8.buf);
   FREE(HUF->x3rgb16.buf);
+  FREE(HUF->plane16[0].buf);
   FREE(HUF);
 
   *HUFP = NULL;
@@ -252,6 +800,9 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
   HUF->table.size = 0;
   HUF->table.element = NULL;
   HUF->tree.nodes = NULL;
+  HUF->lut.size = 0;
+  HUF->lut.entry = NULL;
+  HUF->cached = NULL;
   HUF->row_offsets.size = 0;
   HUF->row_offsets.element = NULL;
   HUF->rgb8.data = NULL;
@@ -265,73 +816,313 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
 }
 
 /* --------------------------------------------------------------------- */
-/* Creating a new x3f structure from file                                */
+/* Allocating planar areas                                               */
 /* --------------------------------------------------------------------- */
 
-/* extern */ x3f_t *x3f_new_from_file(FILE *infile)
-{
-  x3f_t *x3f = (x3f_t *)calloc(1, sizeof(x3f_t));
-  x3f_info_t *I = NULL;
-  x3f_header_t *H = NULL;
-  x3f_directory_section_t *DS = NULL;
-  int i, d;
+/* All planes share one buffer, owned by the first of them */
 
-  I = &x3f->info;
-  I->error = NULL;
-  I->input.file = infile;
-  I->output.file = NULL;
+static void new_planes(x3f_area16_t *plane, int planes,
+		       uint32_t columns, uint32_t rows)
+{
+  uint32_t align = X3F_PLANE_ALIGN/sizeof(uint16_t);
+  uint32_t row_stride = (columns + align - 1)/align*align;
+  size_t plane_size = (size_t)row_stride*rows;
+  uint8_t *buf = (uint8_t *)
+    malloc(planes*plane_size*sizeof(uint16_t) + X3F_PLANE_ALIGN - 1);
+  uint16_t *data = (uint16_t *)
+    (((uintptr_t)buf + X3F_PLANE_ALIGN - 1) &
+     ~(uintptr_t)(X3F_PLANE_ALIGN - 1));
+  int i;
 
-  if (infile == NULL) {
-    I->error = "No infile";
-    return x3f;
+  for (i = 0; i < planes; i++) {
+    plane[i].data = data + i*plane_size;
+    plane[i].buf = i == 0 ? buf : NULL;
+    plane[i].columns = columns;
+    plane[i].rows = rows;
+    plane[i].channels = 1;
+    plane[i].row_stride = row_stride;
   }
+}
 
-  /* Read file header */
-  H = &x3f->header;
-  fseek(infile, 0, SEEK_SET);
-  GET4(H->identifier);
+static int use_planar = 0;
 
-  if (H->identifier != X3F_FOVb) {
-    x3f_printf(ERR, "Faulty file type\n");
-    x3f_delete(x3f);
-    return NULL;
-  }
+/* extern */ void x3f_set_use_planar(int flag)
+{
+  use_planar = flag;
+}
 
-  GET4(H->version);
-  GETN(H->unique_identifier, SIZE_UNIQUE_IDENTIFIER);
-  /* TODO: the meaning of the rest of the header for version >= 4.0
-           (Quattro) is unknown */
-  if (H->version < X3F_VERSION_4_0) {
-    GET4(H->mark_bits);
-    GET4(H->columns);
-    GET4(H->rows);
-    GET4(H->rotation);
-    if (H->version >= X3F_VERSION_2_1) {
-      int num_ext_data =
-	H->version >= X3F_VERSION_3_0 ? NUM_EXT_DATA_3_0 : NUM_EXT_DATA_2_1;
+/* --------------------------------------------------------------------- */
+/* Memory mapping the input file                                         */
+/* --------------------------------------------------------------------- */
 
-      GETN(H->white_balance, SIZE_WHITE_BALANCE);
-      if (H->version >= X3F_VERSION_2_3)
-	GETN(H->color_mode, SIZE_COLOR_MODE);
-      GETN(H->extended_types, num_ext_data);
-      for (i=0; i<num_ext_data; i++)
-	GET4F(H->extended_data[i]);
-    }
-  }
+static int use_mmap = 1;
 
-  /* Go to the beginning of the directory */
-  fseek(infile, -4, SEEK_END);
-  fseek(infile, x3f_get4(infile), SEEK_SET);
+/* extern */ void x3f_set_use_mmap(int flag)
+{
+  use_mmap = flag;
+}
 
-  /* Read the directory header */
-  DS = &x3f->directory_section;
-  GET4(DS->identifier);
-  GET4(DS->version);
+/* Map the whole input file, so that the data blocks can point
+   directly into it instead of being read into allocated memory. The
+   mapping is private, i.e. writes to the data blocks are never seen
+   in the file. If the file cannot be mapped, e.g. if it is a pipe,
+   the data is read as usual. NOTE: this is not done until the first
+   data block is read, as mapping costs more than parsing the header
+   and directory when only the meta data is of interest. */
+
+static void map_input(x3f_info_t *I)
+{
+#ifdef X3F_USE_MMAP
+  struct stat st;
+  void *map;
+
+  if (I->memory.map_tried || I->memory.data != NULL) return;
+  I->memory.map_tried = 1;
+
+  if (!use_mmap) return;
+
+  if (fstat(fileno(I->input.file), &st) != 0 ||
+      !S_ISREG(st.st_mode) || st.st_size <= 0)
+    return;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	     fileno(I->input.file), 0);
+  if (map == MAP_FAILED) {
+    x3f_printf(DEBUG, "Could not map input, reading it instead\n");
+    return;
+  }
+
+  I->memory.data = (uint8_t *)map;
+  I->memory.size = st.st_size;
+  I->memory.mapped = 1;
+#endif
+}
+
+static void release_input(x3f_info_t *I)
+{
+#ifdef X3F_USE_MMAP
+  if (I->memory.mapped)
+    munmap(I->memory.data, I->memory.size);
+#endif
+  if (!I->memory.mapped && I->memory.free_data != NULL)
+    I->memory.free_data(I->memory.data);
+
+  I->memory.data = NULL;
+  I->memory.size = 0;
+  I->memory.mapped = 0;
+  I->memory.free_data = NULL;
+}
+
+/* The data block is about to be decoded from start to end */
+
+static void advise_sequential(x3f_info_t *I, uint8_t *data, uint32_t size)
+{
+#ifdef X3F_USE_MMAP
+  if (I->memory.mapped) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page - 1);
+
+    madvise((void *)start, (uintptr_t)data + size - start, MADV_SEQUENTIAL);
+  }
+#endif
+}
+
+/* The data block is not needed any more. Only the pages entirely
+   within it are dropped, as the others are shared with the blocks
+   around it. */
+
+static void advise_done(x3f_info_t *I, uint8_t *data, uint32_t size)
+{
+#ifdef X3F_USE_MMAP
+  if (I->memory.mapped && in_input(I, data)) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)data + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)data + size) & ~(page - 1);
+
+    if (start < end)
+      madvise((void *)start, end - start, MADV_DONTNEED);
+  }
+#endif
+}
+
+/* --------------------------------------------------------------------- */
+/* Getting a reference to a directory entry                              */
+/* --------------------------------------------------------------------- */
+
+/* Get the entry after DE, or the first if DE is NULL, of the section
+   type in identifier (X3F_SECp, X3F_SECi or X3F_SECc). NULL when
+   there are no more. Iterates over all entries of that type, e.g. all
+   the images, with:
+     for (DE = NULL; (DE = x3f_get_next(x3f, DE, X3F_SECi)) != NULL; )
+       ... */
+
+/* extern */ x3f_directory_entry_t *x3f_get_next(x3f_t *x3f,
+						 x3f_directory_entry_t *DE,
+						 uint32_t identifier)
+{
+  x3f_directory_section_t *DS;
+  int d;
+
+  if (x3f == NULL) return NULL;
+
+  DS = &x3f->directory_section;
+
+  d = DE == NULL ? 0 : (int)(DE - DS->directory_entry) + 1;
+
+  for (; d<DS->num_directory_entries; d++)
+    if (DS->directory_entry[d].header.identifier == identifier)
+      return &DS->directory_entry[d];
+
+  return NULL;
+}
+
+static x3f_directory_entry_t *x3f_get(x3f_t *x3f,
+                                      uint32_t type,
+                                      uint32_t image_type)
+{
+  x3f_directory_entry_t *DE = NULL;
+
+  while ((DE = x3f_get_next(x3f, DE, type)) != NULL) {
+    x3f_image_data_t *ID = &DE->header.data_subsection.image_data;
+
+    if (type != X3F_SECi || ID->type_format == image_type)
+      return DE;
+  }
+
+  return NULL;
+}
+
+static x3f_directory_entry_t *x3f_find_raw(x3f_t *x3f)
+{
+  x3f_directory_entry_t *DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_X530)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_10BIT)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_TRUE)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_MERRILL)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_QUATTRO)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQ)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQH)) != NULL)
+    return DE;
+
+  return NULL;
+}
+
+/* The getters below are called all the time, so the first entry of
+   each kind is looked up once, when the directory has been read */
+
+static void find_entries(x3f_t *x3f)
+{
+  x3f->entry.raw = x3f_find_raw(x3f);
+  x3f->entry.thumb_plain = x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_PLAIN);
+  x3f->entry.thumb_huffman = x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_HUFFMAN);
+  x3f->entry.thumb_jpeg = x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_JPEG);
+  x3f->entry.camf = x3f_get(x3f, X3F_SECc, 0);
+  x3f->entry.prop = x3f_get(x3f, X3F_SECp, 0);
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f)
+{
+  return x3f == NULL ? NULL : x3f->entry.raw;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_thumb_plain(x3f_t *x3f)
+{
+  return x3f == NULL ? NULL : x3f->entry.thumb_plain;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_thumb_huffman(x3f_t *x3f)
+{
+  return x3f == NULL ? NULL : x3f->entry.thumb_huffman;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_thumb_jpeg(x3f_t *x3f)
+{
+  return x3f == NULL ? NULL : x3f->entry.thumb_jpeg;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_camf(x3f_t *x3f)
+{
+  return x3f == NULL ? NULL : x3f->entry.camf;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_prop(x3f_t *x3f)
+{
+  return x3f == NULL ? NULL : x3f->entry.prop;
+}
+
+/* --------------------------------------------------------------------- */
+/* Creating a new x3f structure from file                                */
+/* --------------------------------------------------------------------- */
+
+/* The header and directory can be parsed by reading the file one
+   value at a time ... */
+
+static int parse_stream(x3f_t *x3f)
+{
+  x3f_info_t *I = &x3f->info;
+  x3f_header_t *H = NULL;
+  x3f_directory_section_t *DS = NULL;
+  int i, d;
+
+  /* Read file header */
+  H = &x3f->header;
+  input_seek(I, 0, SEEK_SET);
+  GET4(H->identifier);
+
+  if (H->identifier != X3F_FOVb) {
+    x3f_printf(ERR, "Faulty file type\n");
+    return 0;
+  }
+
+  GET4(H->version);
+  GETN(H->unique_identifier, SIZE_UNIQUE_IDENTIFIER);
+  /* TODO: the meaning of the rest of the header for version >= 4.0
+           (Quattro) is unknown */
+  if (H->version < X3F_VERSION_4_0) {
+    GET4(H->mark_bits);
+    GET4(H->columns);
+    GET4(H->rows);
+    GET4(H->rotation);
+    if (H->version >= X3F_VERSION_2_1) {
+      int num_ext_data =
+	H->version >= X3F_VERSION_3_0 ? NUM_EXT_DATA_3_0 : NUM_EXT_DATA_2_1;
+
+      GETN(H->white_balance, SIZE_WHITE_BALANCE);
+      if (H->version >= X3F_VERSION_2_3)
+	GETN(H->color_mode, SIZE_COLOR_MODE);
+      GETN(H->extended_types, num_ext_data);
+      for (i=0; i<num_ext_data; i++)
+	GET4F(H->extended_data[i]);
+    }
+  }
+
+  /* Go to the beginning of the directory */
+  input_seek(I, -4, SEEK_END);
+  input_seek(I, x3f_get4(I), SEEK_SET);
+
+  /* Read the directory header */
+  DS = &x3f->directory_section;
+  GET4(DS->identifier);
+  GET4(DS->version);
   GET4(DS->num_directory_entries);
 
   if (DS->num_directory_entries > 0) {
     size_t size = DS->num_directory_entries * sizeof(x3f_directory_entry_t);
-    DS->directory_entry = (x3f_directory_entry_t *)calloc(1, size);
+    DS->directory_entry = (x3f_directory_entry_t *)arena_alloc(&I->arena,
+								size);
   }
 
   /* Traverse the directory */
@@ -350,8 +1141,8 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
     GET4(DE->type);
 
     /* Save current pos and go to the entry */
-    save_dir_pos = ftell(infile);
-    fseek(infile, DE->input.offset, SEEK_SET);
+    save_dir_pos = input_tell(I);
+    input_seek(I, DE->input.offset, SEEK_SET);
 
     /* Read the type independent part of the entry header */
     DEH = &DE->header;
@@ -372,6 +1163,8 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
       /* Set all not read data block pointers to NULL */
       PL->data = NULL;
       PL->data_size = 0;
+      PL->property_index.size = 0;
+      PL->property_index.slot = NULL;
     }
 
     if (DEH->identifier == X3F_SECi) {
@@ -410,184 +1203,397 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
       CAMF->table.element = NULL;
       CAMF->table.size = 0;
       CAMF->tree.nodes = NULL;
+      CAMF->lut.entry = NULL;
       CAMF->decoded_data = NULL;
       CAMF->decoded_data_size = 0;
       CAMF->entry_table.element = NULL;
       CAMF->entry_table.size = 0;
+      CAMF->entry_index.size = 0;
+      CAMF->entry_index.slot = NULL;
     }
 
     /* Reset the file pointer back to the directory */
-    fseek(infile, save_dir_pos, SEEK_SET);
+    input_seek(I, save_dir_pos, SEEK_SET);
   }
 
-  return x3f;
+  return 1;
 }
 
-/* --------------------------------------------------------------------- */
-/* Clean up an x3f structure                                             */
-/* --------------------------------------------------------------------- */
 
-static void free_camf_entry(camf_entry_t *entry)
+/* ... or by reading the header, the directory and each entry header
+   in one go, and parsing them from memory. That is a lot faster when
+   only the meta data of many files is of interest. */
+
+/* Read size bytes at offset into buf. The part that is beyond the end
+   of the input is zeroed. */
+
+static void read_at(x3f_info_t *I, size_t offset, void *buf, size_t size)
 {
-  FREE(entry->property_name);
-  FREE(entry->property_value);
-  FREE(entry->matrix_decoded);
-  FREE(entry->matrix_dim_entry);
+  size_t got = 0;
+
+  if (I->memory.data != NULL) {
+    if (offset < I->memory.size) {
+      got = I->memory.size - offset;
+      if (got > size) got = size;
+      memcpy(buf, I->memory.data + offset, got);
+    }
+  } else {
+#ifdef X3F_USE_MMAP
+    while (got < size) {
+      ssize_t cur = pread(fileno(I->input.file),
+			  (uint8_t *)buf + got, size - got, offset + got);
+      if (cur <= 0) break;
+      got += cur;
+    }
+#else
+    fseek(I->input.file, offset, SEEK_SET);
+    got = fread(buf, 1, size, I->input.file);
+#endif
+  }
+
+  if (got < size)
+    memset((uint8_t *)buf + got, 0, size - got);
 }
 
-/* extern */ x3f_return_t x3f_delete(x3f_t *x3f)
+static size_t input_size(x3f_info_t *I)
 {
-  x3f_directory_section_t *DS;
-  int d;
+  if (I->memory.data != NULL)
+    return I->memory.size;
 
-  if (x3f == NULL)
-    return X3F_ARGUMENT_ERROR;
+  fseek(I->input.file, 0, SEEK_END);
 
-  x3f_printf(DEBUG, "X3F Delete\n");
+  return ftell(I->input.file);
+}
 
-  DS = &x3f->directory_section;
+static uint32_t x3f_mem_get4(uint8_t **p)
+{
+  /* Little endian file */
+  uint32_t v =
+    ((uint32_t)(*p)[0]<<0) + ((uint32_t)(*p)[1]<<8) +
+    ((uint32_t)(*p)[2]<<16) + ((uint32_t)(*p)[3]<<24);
+
+  *p += 4;
+
+  return v;
+}
+
+#define MGET4(_v) do {(_v) = x3f_mem_get4(&M);} while (0)
+#define MGET4F(_v)				\
+  do {						\
+    union {int32_t i; float f;} _tmp;		\
+    _tmp.i = x3f_mem_get4(&M);			\
+    (_v) = _tmp.f;				\
+  } while (0)
+#define MGETN(_v,_s) do {memcpy(_v, M, _s); M += (_s);} while (0)
+
+/* The largest possible file header, i.e. version 3.0 */
+#define X3F_HEADER_MAX_SIZE						\
+  (4*2 + SIZE_UNIQUE_IDENTIFIER + 4*4 + SIZE_WHITE_BALANCE +		\
+   SIZE_COLOR_MODE + NUM_EXT_DATA_3_0*(1 + 4))
+
+#define X3F_DIRECTORY_HEADER_SIZE (3*4)
+#define X3F_DIRECTORY_ENTRY_SIZE (3*4)
+
+/* The largest type dependent entry header, i.e. CAMF */
+#define X3F_ENTRY_HEADER_MAX_SIZE (2*4 + 5*4)
+
+static int parse_bulk(x3f_t *x3f)
+{
+  x3f_info_t *I = &x3f->info;
+  x3f_header_t *H = &x3f->header;
+  x3f_directory_section_t *DS = &x3f->directory_section;
+  uint8_t header[X3F_HEADER_MAX_SIZE];
+  uint8_t dir_header[X3F_DIRECTORY_HEADER_SIZE];
+  uint8_t *dir;
+  uint8_t *M;
+  size_t size = input_size(I);
+  size_t dir_size;
+  uint32_t dir_offset;
+  int i, d;
+
+  /* Parse file header */
+  read_at(I, 0, header, sizeof(header));
+  M = header;
+  MGET4(H->identifier);
+
+  if (H->identifier != X3F_FOVb) {
+    x3f_printf(ERR, "Faulty file type\n");
+    return 0;
+  }
+
+  MGET4(H->version);
+  MGETN(H->unique_identifier, SIZE_UNIQUE_IDENTIFIER);
+  /* TODO: the meaning of the rest of the header for version >= 4.0
+           (Quattro) is unknown */
+  if (H->version < X3F_VERSION_4_0) {
+    MGET4(H->mark_bits);
+    MGET4(H->columns);
+    MGET4(H->rows);
+    MGET4(H->rotation);
+    if (H->version >= X3F_VERSION_2_1) {
+      int num_ext_data =
+	H->version >= X3F_VERSION_3_0 ? NUM_EXT_DATA_3_0 : NUM_EXT_DATA_2_1;
+
+      MGETN(H->white_balance, SIZE_WHITE_BALANCE);
+      if (H->version >= X3F_VERSION_2_3)
+	MGETN(H->color_mode, SIZE_COLOR_MODE);
+      MGETN(H->extended_types, num_ext_data);
+      for (i=0; i<num_ext_data; i++)
+	MGET4F(H->extended_data[i]);
+    }
+  }
+
+  /* Find the directory */
+  read_at(I, size >= 4 ? size - 4 : 0, dir_header, 4);
+  M = dir_header;
+  MGET4(dir_offset);
+
+  /* Parse the directory header */
+  read_at(I, dir_offset, dir_header, sizeof(dir_header));
+  M = dir_header;
+  MGET4(DS->identifier);
+  MGET4(DS->version);
+  MGET4(DS->num_directory_entries);
+
+  if (DS->num_directory_entries == 0)
+    return 1;
+
+  dir_size = (size_t)DS->num_directory_entries * X3F_DIRECTORY_ENTRY_SIZE;
+  if (dir_size > size) {
+    x3f_printf(ERR, "Faulty directory size\n");
+    DS->num_directory_entries = 0;
+    return 0;
+  }
 
+  DS->directory_entry = (x3f_directory_entry_t *)
+    arena_alloc(&I->arena,
+		DS->num_directory_entries * sizeof(x3f_directory_entry_t));
+
+  /* Read all of the directory */
+  dir = (uint8_t *)malloc(dir_size);
+  read_at(I, dir_offset + sizeof(dir_header), dir, dir_size);
+
+  /* Traverse the directory */
   for (d=0; d<DS->num_directory_entries; d++) {
     x3f_directory_entry_t *DE = &DS->directory_entry[d];
-    x3f_directory_entry_header_t *DEH = &DE->header;
+    x3f_directory_entry_header_t *DEH;
+    uint8_t entry_header[X3F_ENTRY_HEADER_MAX_SIZE];
+
+    /* Parse the directory entry info */
+    M = dir + d*X3F_DIRECTORY_ENTRY_SIZE;
+    MGET4(DE->input.offset);
+    MGET4(DE->input.size);
+
+    DE->output.offset = 0;
+    DE->output.size = 0;
+
+    MGET4(DE->type);
+
+    /* Parse the type independent part of the entry header */
+    read_at(I, DE->input.offset, entry_header, sizeof(entry_header));
+    M = entry_header;
+    DEH = &DE->header;
+    MGET4(DEH->identifier);
+    MGET4(DEH->version);
+
+    /* NOTE - the tests below could be made on DE->type instead */
 
     if (DEH->identifier == X3F_SECp) {
       x3f_property_list_t *PL = &DEH->data_subsection.property_list;
-      int i;
 
-      for (i=0; i<PL->property_table.size; i++) {
-	FREE(PL->property_table.element[i].name_utf8);
-	FREE(PL->property_table.element[i].value_utf8);
-      }
+      /* Parse the property part of the header */
+      MGET4(PL->num_properties);
+      MGET4(PL->character_format);
+      MGET4(PL->reserved);
+      MGET4(PL->total_length);
 
-      FREE(PL->property_table.element);
-      FREE(PL->data);
+      /* Set all not read data block pointers to NULL */
+      PL->data = NULL;
+      PL->data_size = 0;
+      PL->property_index.size = 0;
+      PL->property_index.slot = NULL;
     }
 
     if (DEH->identifier == X3F_SECi) {
       x3f_image_data_t *ID = &DEH->data_subsection.image_data;
 
-      cleanup_huffman(&ID->huffman);
-
-      cleanup_true(&ID->tru);
+      /* Parse the image part of the header */
+      MGET4(ID->type);
+      MGET4(ID->format);
+      ID->type_format = (ID->type << 16) + (ID->format);
+      MGET4(ID->columns);
+      MGET4(ID->rows);
+      MGET4(ID->row_stride);
 
-      cleanup_quattro(&ID->quattro);
+      /* Set all not read data block pointers to NULL */
+      ID->huffman = NULL;
 
-      FREE(ID->data);
+      ID->data = NULL;
+      ID->data_size = 0;
     }
 
     if (DEH->identifier == X3F_SECc) {
       x3f_camf_t *CAMF = &DEH->data_subsection.camf;
-      int i;
 
-      FREE(CAMF->data);
-      FREE(CAMF->table.element);
-      cleanup_huffman_tree(&CAMF->tree);
-      FREE(CAMF->decoded_data);
-      for (i=0; i < CAMF->entry_table.size; i++) {
-	free_camf_entry(&CAMF->entry_table.element[i]);
-      }
-      FREE(CAMF->entry_table.element);
+      /* Parse the CAMF part of the header */
+      MGET4(CAMF->type);
+      MGET4(CAMF->tN.val0);
+      MGET4(CAMF->tN.val1);
+      MGET4(CAMF->tN.val2);
+      MGET4(CAMF->tN.val3);
+
+      /* Set all not read data block pointers to NULL */
+      CAMF->data = NULL;
+      CAMF->data_size = 0;
+
+      /* Set all not allocated help pointers to NULL */
+      CAMF->table.element = NULL;
+      CAMF->table.size = 0;
+      CAMF->tree.nodes = NULL;
+      CAMF->lut.entry = NULL;
+      CAMF->decoded_data = NULL;
+      CAMF->decoded_data_size = 0;
+      CAMF->entry_table.element = NULL;
+      CAMF->entry_table.size = 0;
+      CAMF->entry_index.size = 0;
+      CAMF->entry_index.slot = NULL;
     }
   }
 
-  FREE(DS->directory_entry);
-  FREE(x3f);
+  free(dir);
 
-  return X3F_OK;
+  return 1;
+}
+
+static int use_bulk_parse = 1;
+
+/* extern */ void x3f_set_use_bulk_parse(int flag)
+{
+  use_bulk_parse = flag;
+}
+
+static x3f_t *new_x3f(FILE *infile,
+		      void *data, size_t size, void (*free_data)(void *data))
+{
+  x3f_t *x3f = (x3f_t *)calloc(1, sizeof(x3f_t));
+  x3f_info_t *I = NULL;
+  int ok;
+
+  I = &x3f->info;
+  I->error = NULL;
+  I->input.file = infile;
+  I->output.file = NULL;
+  I->memory.data = (uint8_t *)data;
+  I->memory.size = size;
+  I->memory.pos = 0;
+  I->memory.mapped = 0;
+  I->memory.map_tried = 0;
+  I->memory.free_data = free_data;
+
+  if (infile == NULL && data == NULL) {
+    I->error = "No infile";
+    return x3f;
+  }
+
+  if (use_bulk_parse)
+    ok = parse_bulk(x3f);
+  else
+    ok = parse_stream(x3f);
+
+  if (!ok) {
+    /* The caller still owns the data if the parse fails */
+    I->memory.free_data = NULL;
+    x3f_delete(x3f);
+    return NULL;
+  }
+
+  find_entries(x3f);
+
+  return x3f;
+}
+
+/* extern */ x3f_t *x3f_new_from_file(FILE *infile)
+{
+  return new_x3f(infile, NULL, 0, NULL);
+}
+
+/* The data shall stay valid until x3f_delete(), which calls free_data
+   on it unless free_data is NULL. The data blocks point directly into
+   it, so it must not be changed either. If NULL is returned, the data
+   is not taken over, and free_data is never called on it. */
+
+/* extern */ x3f_t *x3f_new_from_memory(void *data, size_t size,
+					void (*free_data)(void *data))
+{
+  return new_x3f(NULL, data, size, free_data);
 }
 
 /* --------------------------------------------------------------------- */
-/* Getting a reference to a directory entry                              */
+/* Clean up an x3f structure                                             */
 /* --------------------------------------------------------------------- */
 
-/* TODO: all those only get the first instance */
+static void free_camf_entry(camf_entry_t *entry)
+{
+  FREE(entry->matrix_decoded);
+}
 
-static x3f_directory_entry_t *x3f_get(x3f_t *x3f,
-                                      uint32_t type,
-                                      uint32_t image_type)
+/* extern */ x3f_return_t x3f_delete(x3f_t *x3f)
 {
+  x3f_info_t *I;
   x3f_directory_section_t *DS;
   int d;
 
-  if (x3f == NULL) return NULL;
+  if (x3f == NULL)
+    return X3F_ARGUMENT_ERROR;
 
+  x3f_printf(DEBUG, "X3F Delete\n");
+
+  I = &x3f->info;
   DS = &x3f->directory_section;
 
   for (d=0; d<DS->num_directory_entries; d++) {
     x3f_directory_entry_t *DE = &DS->directory_entry[d];
     x3f_directory_entry_header_t *DEH = &DE->header;
 
-    if (DEH->identifier == type) {
-      switch (DEH->identifier) {
-      case X3F_SECi:
-        {
-          x3f_image_data_t *ID = &DEH->data_subsection.image_data;
-
-          if (ID->type_format == image_type)
-            return DE;
-        }
-        break;
-      default:
-        return DE;
-      }
-    }
-  }
-
-  return NULL;
-}
-
-/* extern */ x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f)
-{
-  x3f_directory_entry_t *DE;
-
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_X530)) != NULL)
-    return DE;
-
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_10BIT)) != NULL)
-    return DE;
+    if (DEH->identifier == X3F_SECp) {
+      x3f_property_list_t *PL = &DEH->data_subsection.property_list;
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_TRUE)) != NULL)
-    return DE;
+      FREE_DATA(I, PL->data);
+    }
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_MERRILL)) != NULL)
-    return DE;
+    if (DEH->identifier == X3F_SECi) {
+      x3f_image_data_t *ID = &DEH->data_subsection.image_data;
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_QUATTRO)) != NULL)
-    return DE;
+      cleanup_huffman(&ID->huffman);
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQ)) != NULL)
-    return DE;
+      cleanup_true(&ID->tru);
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQH)) != NULL)
-    return DE;
+      cleanup_quattro(&ID->quattro);
 
-  return NULL;
-}
+      cleanup_true_index(&ID->true_index);
 
-/* extern */ x3f_directory_entry_t *x3f_get_thumb_plain(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_PLAIN);
-}
+      FREE_DATA(I, ID->data);
+    }
 
-/* extern */ x3f_directory_entry_t *x3f_get_thumb_huffman(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_HUFFMAN);
-}
+    if (DEH->identifier == X3F_SECc) {
+      x3f_camf_t *CAMF = &DEH->data_subsection.camf;
+      int i;
 
-/* extern */ x3f_directory_entry_t *x3f_get_thumb_jpeg(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_JPEG);
-}
+      FREE_DATA(I, CAMF->data);
+      cleanup_huffman_tree(&CAMF->tree);
+      cleanup_true_lut(&CAMF->lut);
+      FREE(CAMF->decoded_data);
+      for (i=0; i < CAMF->entry_table.size; i++) {
+	free_camf_entry(&CAMF->entry_table.element[i]);
+      }
+    }
+  }
 
-/* extern */ x3f_directory_entry_t *x3f_get_camf(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECc, 0);
-}
+  release_input(I);
+  arena_free(&I->arena);
+  FREE(x3f);
 
-/* extern */ x3f_directory_entry_t *x3f_get_prop(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECp, 0);
+  return X3F_OK;
 }
 
 /* For some obscure reason, the bit numbering is weird. It is
@@ -597,7 +1603,25 @@ static x3f_directory_entry_t *x3f_get(x3f_t *x3f,
    next one. */
 
 #define PATTERN_BIT_POS(_len, _bit) ((_len) - (_bit) - 1)
-#define MEMORY_BIT_POS(_bit) PATTERN_BIT_POS(8, _bit)
+
+/* --------------------------------------------------------------------- */
+/* What to load of an image                                              */
+/* --------------------------------------------------------------------- */
+
+/* Set up on the stack by the x3f_load_data functions and handed down
+   to the decoders, so nothing of it is left in the image data */
+
+typedef struct load_request_s {
+  uint32_t *rect;		/* Left, top, right, bottom (inclusive),
+				   or NULL for all of the image */
+  uint32_t bin;			/* Bin size, 1 if not binned */
+
+  /* If callback is not NULL, the TRUE planes are decoded together in
+     bands of band_rows rows, each handed to callback when done */
+  uint32_t band_rows;
+  x3f_band_callback_t callback;
+  void *ctx;
+} load_request_t;
 
 /* --------------------------------------------------------------------- */
 /* Huffman Decode                                                        */
@@ -621,17 +1645,15 @@ static char *display_code(int length, uint32_t code, char *buffer)
 }
 #endif
 
-static x3f_huffnode_t *new_node(x3f_hufftree_t *tree)
+static uint16_t new_node(x3f_hufftree_t *tree)
 {
   x3f_huffnode_t *t = &tree->nodes[tree->free_node_index];
 
-  t->branch[0] = NULL;
-  t->branch[1] = NULL;
+  t->branch[0] = 0;
+  t->branch[1] = 0;
   t->leaf = UNDEFINED_LEAF;
 
-  tree->free_node_index++;
-
-  return t;
+  return tree->free_node_index++;
 }
 
 static void add_code_to_tree(x3f_hufftree_t *tree,
@@ -639,20 +1661,61 @@ static void add_code_to_tree(x3f_hufftree_t *tree,
 {
   int i;
 
-  x3f_huffnode_t *t = tree->nodes;
+  uint16_t t = 0;
 
   for (i=0; i<length; i++) {
     int pos = PATTERN_BIT_POS(length, i);
     int bit = (code>>pos)&1;
-    x3f_huffnode_t *t_next = t->branch[bit];
+    uint16_t t_next = tree->nodes[t].branch[bit];
 
-    if (t_next == NULL)
-      t_next = t->branch[bit] = new_node(tree);
+    if (t_next == 0)
+      t_next = tree->nodes[t].branch[bit] = new_node(tree);
 
     t = t_next;
   }
 
-  t->leaf = value;
+  tree->nodes[t].leaf = value;
+}
+
+/* Lay out the nodes breadth first, so that the first levels, which
+   are visited the most, share cache lines, and free the unused
+   nodes */
+
+static void compact_huffman_tree(x3f_hufftree_t *tree)
+{
+  uint32_t n = tree->free_node_index;
+  x3f_huffnode_t *nodes =
+    (x3f_huffnode_t *)malloc(n*sizeof(x3f_huffnode_t));
+  uint16_t *order = (uint16_t *)malloc(n*sizeof(uint16_t));
+  uint16_t *index = (uint16_t *)malloc(n*sizeof(uint16_t));
+  uint32_t head, tail = 0;
+  int b;
+
+  /* order[i] is the old index of node number i breadth first */
+  order[tail++] = 0;
+  for (head = 0; head < tail; head++) {
+    uint16_t old = order[head];
+
+    index[old] = head;
+    for (b=0; b<2; b++)
+      if (tree->nodes[old].branch[b] != 0)
+	order[tail++] = tree->nodes[old].branch[b];
+  }
+
+  for (head = 0; head < tail; head++) {
+    nodes[head] = tree->nodes[order[head]];
+    for (b=0; b<2; b++)
+      if (nodes[head].branch[b] != 0)
+	nodes[head].branch[b] = index[nodes[head].branch[b]];
+  }
+
+  free(order);
+  free(index);
+  free(tree->nodes);
+
+  tree->nodes = nodes;
+  tree->free_node_index = tail;
+  tree->total_node_count = tail;
 }
 
 static void populate_true_huffman_tree(x3f_hufftree_t *tree,
@@ -684,6 +1747,8 @@ static void populate_true_huffman_tree(x3f_hufftree_t *tree,
 #endif
     }
   }
+
+  compact_huffman_tree(tree);
 }
 
 static void populate_huffman_tree(x3f_hufftree_t *tree,
@@ -723,79 +1788,52 @@ static void populate_huffman_tree(x3f_hufftree_t *tree,
 #endif
     }
   }
+
+  compact_huffman_tree(tree);
 }
 
 #ifdef DBG_PRNT
-static void print_huffman_tree(x3f_huffnode_t *t, int length, uint32_t code)
+static void print_huffman_tree(x3f_hufftree_t *tree, uint16_t node,
+			       int length, uint32_t code)
 {
+  x3f_huffnode_t *t = &tree->nodes[node];
   char buf1[100];
   char buf2[100];
 
   x3f_printf(DEBUG, "%*s (%s,%s) %s (%s)\n",
 	     length, length < 1 ? "-" : (code&1) ? "1" : "0",
-	     t->branch[0]==NULL ? "-" : "0",
-	     t->branch[1]==NULL ? "-" : "1",
+	     t->branch[0]==0 ? "-" : "0",
+	     t->branch[1]==0 ? "-" : "1",
 	     t->leaf==UNDEFINED_LEAF ? "-" : (sprintf(buf1, "%x", t->leaf),buf1),
 	     display_code(length, code, buf2));
 
   code = code << 1;
-  if (t->branch[0]) print_huffman_tree(t->branch[0], length+1, code+0);
-  if (t->branch[1]) print_huffman_tree(t->branch[1], length+1, code+1);
+  if (t->branch[0]) print_huffman_tree(tree, t->branch[0], length+1, code+0);
+  if (t->branch[1]) print_huffman_tree(tree, t->branch[1], length+1, code+1);
 }
 #endif
 
-/* Help machinery for reading bits in a memory */
-
-typedef struct bit_state_s {
-  uint8_t *next_address;
-  uint8_t bit_offset;
-  uint8_t bits[8];
-} bit_state_t;
-
-static void set_bit_state(bit_state_t *BS, uint8_t *address)
-{
-  BS->next_address = address;
-  BS->bit_offset = 8;
-}
-
-static uint8_t get_bit(bit_state_t *BS)
-{
-  if (BS->bit_offset == 8) {
-    uint8_t byte = *BS->next_address;
-    int i;
-
-    for (i=7; i>= 0; i--) {
-      BS->bits[i] = byte&1;
-      byte = byte >> 1;
-    }
-    BS->next_address++;
-    BS->bit_offset = 0;
-  }
-
-  return BS->bits[BS->bit_offset++];
-}
-
 /* Decode use the TRUE algorithm */
 
 static int32_t get_true_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
 {
   int32_t diff;
-  x3f_huffnode_t *node = &HTP->nodes[0];
+  x3f_huffnode_t *nodes = HTP->nodes;
+  uint16_t node = 0;
   uint8_t bits;
 
-  while (node->branch[0] != NULL || node->branch[1] != NULL) {
+  while (nodes[node].branch[0] != 0 || nodes[node].branch[1] != 0) {
     uint8_t bit = get_bit(BS);
-    x3f_huffnode_t *new_node = node->branch[bit];
 
-    node = new_node;
-    if (node == NULL) {
+    node = nodes[node].branch[bit];
+    if (node == 0) {
       /* TODO: Shouldn't this be treated as a fatal error? */
       x3f_printf(ERR, "Huffman coding got unexpected bit\n");
       return 0;
     }
   }
 
-  bits = node->leaf;
+  bits = nodes[node].leaf;
 
   if (bits == 0)
     diff = 0;
@@ -815,6 +1853,89 @@ static int32_t get_true_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
   return diff;
 }
 
+/* The payload of a TRUE code is a bits long number where a leading
+   zero means that the diff is negative */
+#define TRUE_PAYLOAD_DIFF(_v, _bits)					\
+  (((_v) >> ((_bits) - 1)) ? (int32_t)(_v) :				\
+   (int32_t)(_v) - ((1<<(_bits)) - 1))
+
+/* Make the TRUE lookup table. It is filled by walking the tree, so
+   that any quirks of the tree (e.g. missing branches) are kept by
+   letting those entries fall back to get_true_diff(). */
+
+#define TRUE_LUT_MAX_PAYLOAD 24
+
+static void populate_true_lut(x3f_true_lut_t *LUT, x3f_hufftree_t *tree,
+			      uint16_t index, int length, uint32_t code)
+{
+  x3f_huffnode_t *node = &tree->nodes[index];
+
+  if (node->branch[0] == 0 && node->branch[1] == 0) {
+    uint8_t bits = node->leaf;
+    int span = X3F_TRUE_LUT_BITS - length;
+    uint32_t i;
+
+    /* The empty code and huge payloads are left to the tree */
+    if (length == 0 || bits > TRUE_LUT_MAX_PAYLOAD) return;
+
+    for (i=0; i < (1<<span); i++) {
+      x3f_true_lut_entry_t *e = &LUT->entry[(code << span) + i];
+
+      e->code_length = length;
+
+      if (bits <= span) {
+	uint32_t payload = (i >> (span - bits)) & ((1<<bits) - 1);
+
+	e->diff = bits == 0 ? 0 : TRUE_PAYLOAD_DIFF(payload, bits);
+	e->total_length = length + bits;
+      } else {
+	e->diff = bits;
+	e->total_length = 0;
+      }
+    }
+
+    return;
+  }
+
+  /* Codes longer than the index are left to the tree */
+  if (length == X3F_TRUE_LUT_BITS) return;
+
+  if (node->branch[0])
+    populate_true_lut(LUT, tree, node->branch[0], length+1, (code<<1) + 0);
+  if (node->branch[1])
+    populate_true_lut(LUT, tree, node->branch[1], length+1, (code<<1) + 1);
+}
+
+/* Same as get_true_diff(), but normally resolving both the code and
+   the payload with one lookup */
+
+static int32_t get_true_diff_lut(bit_state_t *BS, x3f_true_lut_t *LUT,
+				 x3f_hufftree_t *HTP)
+{
+  x3f_true_lut_entry_t e;
+
+  fill_bits(BS);
+  e = LUT->entry[peek_bits(BS, X3F_TRUE_LUT_BITS)];
+
+  if (e.total_length != 0) {
+    consume_bits(BS, e.total_length);
+    return e.diff;
+  }
+
+  if (e.code_length != 0) {
+    int bits = e.diff;
+    uint32_t payload;
+
+    consume_bits(BS, e.code_length);
+    payload = peek_bits(BS, bits);
+    consume_bits(BS, bits);
+
+    return TRUE_PAYLOAD_DIFF(payload, bits);
+  }
+
+  return get_true_diff(BS, HTP);
+}
+
 /* This code (that decodes one of the X3F color planes, really is a
    decoding of a compression algorithm suited for Bayer CFA data. In
    Bayer CFA the data is divided into 2x2 squares that represents
@@ -826,115 +1947,628 @@ static int32_t get_true_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
 
 /* TODO: write more about the compression */
 
-static void true_decode_one_color(x3f_image_data_t *ID, int color)
+/* Where, and how big, the decoded plane is. Only the rows and columns
+   in the window are stored, the rest are just decoded. */
+
+typedef struct true_plane_s {
+  uint32_t rows;
+  uint32_t cols;
+  x3f_area16_t *area;
+  uint16_t *dst;		/* First row and column of the window */
+  uint32_t window[4];		/* Left, top, right, bottom, inclusive */
+  uint32_t bin;			/* Bin size, 1 if not binned */
+} true_plane_t;
+
+/* Number of bins needed for size rows or columns */
+static uint32_t bin_count(uint32_t size, uint32_t bin)
+{
+  return (size + bin - 1) / bin;
+}
+
+/* The window of the plane, given the region of interest. For Quattro,
+   the two lower planes have half the resolution. The binned Quattro
+   top plane has extra columns at the right, that are never stored. */
+
+static void true_get_window(x3f_image_data_t *ID, const load_request_t *req,
+			    int color, uint32_t rows, uint32_t cols,
+			    uint32_t *window)
 {
-  x3f_true_t *TRU = ID->tru;
   x3f_quattro_t *Q = ID->quattro;
-  uint32_t seed = TRU->seed[color]; /* TODO : Is this correct ? */
-  int row;
+  int shift = Q != NULL && Q->quattro_layout && color < 2;
+  int i;
 
-  x3f_hufftree_t *tree = &TRU->tree;
-  bit_state_t BS;
+  if (Q == NULL || Q->quattro_layout == 0)
+    cols = ID->columns;
 
-  int32_t row_start_acc[2][2];
-  uint32_t rows = ID->rows;
-  uint32_t cols = ID->columns;
-  x3f_area16_t *area = &TRU->x3rgb16;
-  uint16_t *dst = area->data + color;
+  if (req->rect == NULL) {
+    window[0] = 0;
+    window[1] = 0;
+    window[2] = cols - 1;
+    window[3] = rows - 1;
+    return;
+  }
 
-  set_bit_state(&BS, TRU->plane_address[color]);
+  for (i = 0; i < 4; i++)
+    window[i] = req->rect[i] >> shift;
 
-  row_start_acc[0][0] = seed;
-  row_start_acc[0][1] = seed;
-  row_start_acc[1][0] = seed;
-  row_start_acc[1][1] = seed;
+  if (window[2] >= cols) window[2] = cols - 1;
+  if (window[3] >= rows) window[3] = rows - 1;
+}
+
+static void true_get_plane(x3f_image_data_t *ID, const load_request_t *req,
+			   int color, true_plane_t *P)
+{
+  x3f_true_t *TRU = ID->tru;
+  x3f_quattro_t *Q = ID->quattro;
+
+  P->rows = ID->rows;
+  P->cols = ID->columns;
+  if (ID->planar) {
+    P->area = &TRU->plane16[color];
+    P->dst = P->area->data;
+  } else {
+    P->area = &TRU->x3rgb16;
+    P->dst = P->area->data + color;
+  }
 
   if (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
       ID->type_format == X3F_IMAGE_RAW_SDQ ||
       ID->type_format == X3F_IMAGE_RAW_SDQH) {
-    rows = Q->plane[color].rows;
-    cols = Q->plane[color].columns;
+    P->rows = Q->plane[color].rows;
+    P->cols = Q->plane[color].columns;
 
     if (Q->quattro_layout && color == 2) {
-      area = &Q->top16;
-      dst = area->data;
+      P->area = &Q->top16;
+      P->dst = P->area->data;
     }
-    x3f_printf(DEBUG, "Quattro decode one color (%d) rows=%d cols=%d\n",
-	       color, rows, cols);
-  } else {
-    x3f_printf(DEBUG, "TRUE decode one color (%d) rows=%d cols=%d\n",
-	       color, rows, cols);
   }
 
-  assert(rows == area->rows && cols >= area->columns);
+  true_get_window(ID, req, color, P->rows, P->cols, P->window);
+  P->bin = req->bin;
 
-  for (row = 0; row < rows; row++) {
+  assert(bin_count(P->window[3] - P->window[1] + 1, P->bin) ==
+	 P->area->rows &&
+	 bin_count(P->window[2] - P->window[0] + 1, P->bin) ==
+	 P->area->columns &&
+	 P->window[2] < P->cols);
+}
+
+/* Store the mean of each bin, given the sums of bin_rows rows, and
+   clear the sums for the next row of bins */
+
+static void true_store_bins(true_plane_t *P, uint32_t *sum,
+			    uint16_t *dst, uint32_t bin_rows)
+{
+  x3f_area16_t *area = P->area;
+  uint32_t width = P->window[2] - P->window[0] + 1;
+  uint32_t i;
+
+  for (i = 0; i < area->columns; i++) {
+    uint32_t bin_cols = width - i*P->bin < P->bin ? width - i*P->bin : P->bin;
+    uint32_t n = bin_cols*bin_rows;
+
+    dst[i*area->channels] = (sum[i] + n/2) / n;
+    sum[i] = 0;
+  }
+}
+
+/* The sums of one row of bins, NULL if not binned */
+
+static uint32_t *true_new_sums(true_plane_t *P)
+{
+  return P->bin > 1 ?
+    (uint32_t *)calloc(P->area->columns, sizeof(uint32_t)) : NULL;
+}
+
+/* Decode the rows from row up to, but not including, end. BS and
+   row_start_acc shall be the state at the start of row. If restart is
+   not NULL, the state is recorded there every TRUE_RESTART_ROWS
+   rows. If binned, the values are summed per bin in sum, and stored
+   when the last row of the bin is decoded. A bin may thus be split
+   between two calls, as long as sum is kept. */
+
+static void true_decode_rows(x3f_image_data_t *ID, true_plane_t *P,
+			     uint32_t row, uint32_t end,
+			     bit_state_t *BS, int32_t row_start_acc[2][2],
+			     x3f_true_restart_t *restart, uint32_t *sum)
+{
+  x3f_true_t *TRU = ID->tru;
+  x3f_hufftree_t *tree = &TRU->tree;
+  x3f_true_lut_t *lut = &TRU->lut;
+  x3f_area16_t *area = P->area;
+  uint32_t cols = P->cols;
+  uint32_t left = P->window[0];
+  uint32_t top = P->window[1];
+  uint32_t width = P->window[2] - left + 1;
+  uint32_t bin = P->bin;
+
+  for (; row < end; row++) {
     int col;
     bool_t odd_row = row&1;
     int32_t acc[2];
+    /* Rows above the window are decoded, but nothing is stored */
+    uint32_t store_cols = row >= top ? width : 0;
+    uint16_t *dst = row >= top ?
+      P->dst + (row - top)/bin*area->row_stride : NULL;
+    uint32_t *bin_sum = sum;
+    uint32_t bin_col = 0;
+
+    if (restart != NULL && row % TRUE_RESTART_ROWS == 0) {
+      x3f_true_restart_t *R = &restart[row / TRUE_RESTART_ROWS];
+
+      R->bit_offset = get_bit_pos(BS);
+      memcpy(R->row_start_acc, row_start_acc, sizeof(R->row_start_acc));
+    }
 
     for (col = 0; col < cols; col++) {
       bool_t odd_col = col&1;
-      int32_t diff = get_true_diff(&BS, tree);
+      int32_t diff = get_true_diff_lut(BS, lut, tree);
       int32_t prev = col < 2 ?
 	row_start_acc[odd_row][odd_col] :
 	acc[odd_col];
       int32_t value = prev + diff;
 
-      acc[odd_col] = value;
-      if (col < 2)
-	row_start_acc[odd_row][odd_col] = value;
+      acc[odd_col] = value;
+      if (col < 2)
+	row_start_acc[odd_row][odd_col] = value;
+
+      /* Discard data outside the window, e.g. the additional data at
+	 the right for binned Quattro plane 2 */
+      if ((uint32_t)(col - left) >= store_cols) continue;
+
+      if (sum == NULL) {
+	*dst = value;
+	dst += area->channels;
+      } else {
+	*bin_sum += (uint16_t)value;
+	if (++bin_col == bin) {
+	  bin_sum++;
+	  bin_col = 0;
+	}
+      }
+    }
+
+    if (sum != NULL && row >= top &&
+	((row - top + 1) % bin == 0 || row == P->window[3]))
+      true_store_bins(P, sum, dst, (row - top) % bin + 1);
+  }
+}
+
+/* Set up the decoding of the plane P from its first row. Returns
+   where to record the restart points, or NULL if they shall not be
+   recorded. An index that is already known is not recorded again. */
+
+static x3f_true_restart_t *true_start_plane(x3f_image_data_t *ID, int color,
+					    true_plane_t *P, bit_state_t *BS,
+					    int32_t row_start_acc[2][2])
+{
+  x3f_true_t *TRU = ID->tru;
+  x3f_true_index_t *index = ID->true_index;
+  uint32_t seed = TRU->seed[color]; /* TODO : Is this correct ? */
+
+  if (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
+      ID->type_format == X3F_IMAGE_RAW_SDQ ||
+      ID->type_format == X3F_IMAGE_RAW_SDQH)
+    x3f_printf(DEBUG, "Quattro decode one color (%d) rows=%d cols=%d\n",
+	       color, P->rows, P->cols);
+  else
+    x3f_printf(DEBUG, "TRUE decode one color (%d) rows=%d cols=%d\n",
+	       color, P->rows, P->cols);
+
+  set_bit_state(BS, TRU->plane_address[color],
+		(uint8_t *)ID->data + ID->data_size);
+
+  row_start_acc[0][0] = seed;
+  row_start_acc[0][1] = seed;
+  row_start_acc[1][0] = seed;
+  row_start_acc[1][1] = seed;
+
+  if (index == NULL || index->plane[color].element != NULL)
+    return NULL;
+
+  index->plane[color].size =
+    (P->rows + TRUE_RESTART_ROWS - 1) / TRUE_RESTART_ROWS;
+  index->plane[color].element = (x3f_true_restart_t *)
+    malloc(index->plane[color].size * sizeof(x3f_true_restart_t));
+
+  return index->plane[color].element;
+}
+
+/* Decode one plane down to the last row of the window, recording the
+   restart points if all of it is decoded */
+
+static void true_decode_one_color(x3f_image_data_t *ID, true_plane_t *P,
+				  int color)
+{
+  int32_t row_start_acc[2][2];
+  x3f_true_restart_t *restart;
+  bit_state_t BS;
+  uint32_t *sum;
+
+  restart = true_start_plane(ID, color, P, &BS, row_start_acc);
+  sum = true_new_sums(P);
+
+  true_decode_rows(ID, P, 0, restart != NULL ? P->rows : P->window[3] + 1,
+		   &BS, row_start_acc, restart, sum);
+
+  free(sum);
+}
+
+/* The planes to decode, and the bands of them if decoded from the
+   restart points */
+
+typedef struct true_job_s {
+  x3f_image_data_t *ID;
+  true_plane_t plane[TRUE_PLANES];
+  int first[TRUE_PLANES];	/* First band of each plane */
+  int bands[TRUE_PLANES];	/* Number of bands of each plane */
+} true_job_t;
+
+static void true_decode_one_color_task(void *ctx, int color)
+{
+  true_job_t *job = (true_job_t *)ctx;
+
+  true_decode_one_color(job->ID, &job->plane[color], color);
+}
+
+/* Decode the rows of one plane starting at one restart point */
+
+static void true_decode_band(x3f_image_data_t *ID, true_plane_t *P,
+			     int color, int band)
+{
+  x3f_true_t *TRU = ID->tru;
+  x3f_true_restart_t *R = &ID->true_index->plane[color].element[band];
+  int32_t row_start_acc[2][2];
+  uint32_t row = band * ID->true_index->rows;
+  uint32_t end = row + ID->true_index->rows;
+  bit_state_t BS;
+  uint32_t *sum;
+
+  if (end > P->window[3] + 1) end = P->window[3] + 1;
+
+  set_bit_state(&BS, TRU->plane_address[color] + R->bit_offset/8,
+		(uint8_t *)ID->data + ID->data_size);
+  if (R->bit_offset%8) {
+    fill_bits(&BS);
+    consume_bits(&BS, R->bit_offset%8);
+  }
+
+  memcpy(row_start_acc, R->row_start_acc, sizeof(row_start_acc));
+
+  sum = true_new_sums(P);
+  true_decode_rows(ID, P, row, end, &BS, row_start_acc, NULL, sum);
+  free(sum);
+}
+
+static void true_decode_band_task(void *ctx, int band)
+{
+  true_job_t *job = (true_job_t *)ctx;
+  int color;
+
+  for (color = 0; band >= job->bands[color]; color++)
+    band -= job->bands[color];
+
+  true_decode_band(job->ID, &job->plane[color], color,
+		   job->first[color] + band);
+}
+
+/* Check that the restart points fit the image */
+
+static int true_index_valid(x3f_image_data_t *ID, true_plane_t *plane)
+{
+  x3f_true_index_t *index = ID->true_index;
+  uint8_t *end = (uint8_t *)ID->data + ID->data_size;
+  int color;
+
+  if (index->rows != TRUE_RESTART_ROWS)
+    return 0;
+
+  for (color = 0; color < TRUE_PLANES; color++) {
+    /* Each plane is bounded by its own size, and by the data */
+    uint64_t plane_bytes = ID->tru->plane_size.element[color];
+    uint64_t plane_bits;
+    uint32_t i;
+
+    if (plane_bytes > (uint64_t)(end - ID->tru->plane_address[color]))
+      plane_bytes = end - ID->tru->plane_address[color];
+    plane_bits = plane_bytes * 8;
+
+    if (index->plane[color].size !=
+	(plane[color].rows + TRUE_RESTART_ROWS - 1) / TRUE_RESTART_ROWS)
+      return 0;
+
+    for (i = 0; i < index->plane[color].size; i++)
+      if (index->plane[color].element[i].bit_offset > plane_bits)
+	return 0;
+  }
+
+  return 1;
+}
+
+/* Check that no bin is split between two bands */
+
+static int true_bands_fit_bins(x3f_image_data_t *ID, true_plane_t *plane)
+{
+  uint32_t bin = plane[0].bin;
+  int color;
+
+  if (ID->true_index->rows % bin != 0)
+    return 0;
+
+  for (color = 0; color < TRUE_PLANES; color++)
+    if (plane[color].window[1] % bin != 0)
+      return 0;
+
+  return 1;
+}
+
+/* Decode all planes together, in bands of req->band_rows rows of
+   the area of plane 0, calling req->callback as soon as a band is
+   done in all planes. The planes of each band are decoded in
+   parallel. For the Quattro layout, the top plane has twice as many
+   rows per band. */
+
+typedef struct true_stream_s {
+  x3f_image_data_t *ID;
+  struct {
+    true_plane_t P;
+    bit_state_t BS;
+    int32_t row_start_acc[2][2];
+    x3f_true_restart_t *restart;
+    uint32_t *sum;
+    uint32_t row;		/* Next row to decode */
+    uint32_t end;		/* Last row of the band + 1 */
+    uint32_t last;		/* Last row of the plane + 1 */
+    uint32_t scale;		/* Rows per row of plane 0 */
+  } plane[TRUE_PLANES];
+} true_stream_t;
+
+static void true_decode_stream_task(void *ctx, int color)
+{
+  true_stream_t *S = (true_stream_t *)ctx;
+
+  true_decode_rows(S->ID, &S->plane[color].P,
+		   S->plane[color].row, S->plane[color].end,
+		   &S->plane[color].BS, S->plane[color].row_start_acc,
+		   S->plane[color].restart, S->plane[color].sum);
+  S->plane[color].row = S->plane[color].end;
+}
+
+static void true_decode_streamed(x3f_image_data_t *ID, true_plane_t *plane,
+				 const load_request_t *req)
+{
+  x3f_quattro_t *Q = ID->quattro;
+  uint32_t bin = plane[0].bin;
+  uint32_t band_rows = req->band_rows > 0 ? req->band_rows : 1;
+  uint32_t rows, row;
+  true_stream_t S;
+  int color;
+
+  S.ID = ID;
+  for (color = 0; color < TRUE_PLANES; color++) {
+    true_plane_t *P = &S.plane[color].P;
+
+    *P = plane[color];
+    S.plane[color].restart =
+      true_start_plane(ID, color, P,
+		       &S.plane[color].BS, S.plane[color].row_start_acc);
+    S.plane[color].sum = true_new_sums(P);
+    S.plane[color].row = 0;
+    S.plane[color].last =
+      S.plane[color].restart != NULL ? P->rows : P->window[3] + 1;
+    S.plane[color].scale =
+      Q != NULL && Q->quattro_layout && color == 2 ? 2 : 1;
+  }
+
+  rows = S.plane[0].P.area->rows;
+
+  x3f_printf(DEBUG, "TRUE decode streamed in bands of %d rows\n", band_rows);
+
+  for (row = 0; row < rows; row += band_rows) {
+    uint32_t end = row + band_rows < rows ? row + band_rows : rows;
+
+    for (color = 0; color < TRUE_PLANES; color++) {
+      uint32_t plane_end = S.plane[color].P.window[1] +
+	S.plane[color].scale * end * bin;
+
+      S.plane[color].end = end == rows || plane_end > S.plane[color].last ?
+	S.plane[color].last : plane_end;
+    }
+
+    x3f_parallel_for(TRUE_PLANES, true_decode_stream_task, &S);
+
+    req->callback(req->ctx, row, end - row);
+  }
+
+  for (color = 0; color < TRUE_PLANES; color++)
+    free(S.plane[color].sum);
+}
+
+/* The planes are separate bit streams, written to separate channels
+   or areas, so they are decoded in parallel. If the restart points
+   are known, e.g. from an earlier decode of the same file, then each
+   plane is split into bands that are decoded in parallel too. That is
+   not done if the bands are to be handed over as they are done. */
+
+static void true_decode(x3f_info_t *I,
+			x3f_directory_entry_t *DE,
+			const load_request_t *req)
+{
+  x3f_directory_entry_header_t *DEH = &DE->header;
+  x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  true_job_t job;
+  int color;
+
+  job.ID = ID;
+  for (color = 0; color < TRUE_PLANES; color++)
+    true_get_plane(ID, req, color, &job.plane[color]);
+
+  if (ID->true_index != NULL && !true_index_valid(ID, job.plane)) {
+    x3f_printf(ERR, "TRUE restart index does not match image, ignored\n");
+    cleanup_true_index(&ID->true_index);
+  }
+
+  if (req->callback == NULL &&
+      ID->true_index != NULL && true_bands_fit_bins(ID, job.plane)) {
+    int bands = 0;
+
+    /* Only the bands that overlap the window */
+    for (color = 0; color < TRUE_PLANES; color++) {
+      true_plane_t *P = &job.plane[color];
+
+      job.first[color] = P->window[1] / ID->true_index->rows;
+      job.bands[color] = P->window[3] / ID->true_index->rows + 1 -
+	job.first[color];
+      bands += job.bands[color];
+    }
+
+    x3f_printf(DEBUG, "TRUE decode in %d bands\n", bands);
+    x3f_parallel_for(bands, true_decode_band_task, &job);
+  } else {
+    /* The restart points are only known if all rows are decoded */
+    if (ID->true_index == NULL && req->rect == NULL) {
+      ID->true_index =
+	(x3f_true_index_t *)calloc(1, sizeof(x3f_true_index_t));
+      ID->true_index->rows = TRUE_RESTART_ROWS;
+    }
+
+    if (req->callback != NULL)
+      true_decode_streamed(ID, job.plane, req);
+    else
+      x3f_parallel_for(TRUE_PLANES, true_decode_one_color_task, &job);
+  }
+}
+
+/* Decode use the huffman tree, flattened into a multi level lookup
+   table */
+
+static int huffman_tree_depth(x3f_hufftree_t *tree, uint16_t index)
+{
+  x3f_huffnode_t *node = &tree->nodes[index];
+  int depth = 0;
+  int b;
+
+  for (b=0; b<2; b++)
+    if (node->branch[b] != 0) {
+      int d = huffman_tree_depth(tree, node->branch[b]);
+
+      if (d > depth) depth = d;
+    }
+
+  return node->branch[0] == 0 && node->branch[1] == 0 ? 0 : depth + 1;
+}
+
+static void populate_huff_lut(x3f_huff_lut_t *LUT,
+			      uint32_t table, int table_bits,
+			      x3f_hufftree_t *tree, uint16_t index,
+			      int length, uint32_t code)
+{
+  x3f_huffnode_t *node = &tree->nodes[index];
+  int span = table_bits - length;
+  uint32_t first = table + (code << span);
+  uint32_t i;
+  int b;
+
+  if (node->branch[0] == 0 && node->branch[1] == 0) {
+    for (i=0; i < (1<<span); i++) {
+      LUT->entry[first + i].value = node->leaf;
+      LUT->entry[first + i].length = length;
+    }
+    return;
+  }
+
+  if (span == 0) {
+    int sub_bits = huffman_tree_depth(tree, index);
+    uint32_t sub;
+
+    if (sub_bits > X3F_HUFF_LUT_SUB_BITS) sub_bits = X3F_HUFF_LUT_SUB_BITS;
+
+    /* NOTE: may move LUT->entry */
+    sub = new_huff_lut_table(LUT, sub_bits);
+
+    LUT->entry[first].value = sub;
+    LUT->entry[first].length = length;
+    LUT->entry[first].sub_bits = sub_bits;
+
+    populate_huff_lut(LUT, sub, sub_bits, tree, index, 0, 0);
+    return;
+  }
+
+  for (b=0; b<2; b++) {
+    uint32_t next_code = (code<<1) + b;
 
-      /* Discard additional data at the right for binned Quattro plane 2 */
-      if (col >= area->columns) continue;
+    if (node->branch[b] != 0)
+      populate_huff_lut(LUT, table, table_bits,
+			tree, node->branch[b], length+1, next_code);
+    else {
+      /* A missing branch is reported after reading the bad bit */
+      uint32_t next_first = table + (next_code << (span - 1));
 
-      *dst = value;
-      dst += area->channels;
+      for (i=0; i < (1<<(span - 1)); i++) {
+	LUT->entry[next_first + i].length = length + 1;
+	LUT->entry[next_first + i].invalid = 1;
+      }
     }
   }
 }
 
-static void true_decode(x3f_info_t *I,
-			x3f_directory_entry_t *DE)
+static void new_huff_lut(x3f_huff_lut_t *LUT, x3f_hufftree_t *tree)
 {
-  x3f_directory_entry_header_t *DEH = &DE->header;
-  x3f_image_data_t *ID = &DEH->data_subsection.image_data;
-  int color;
+  uint32_t table = new_huff_lut_table(LUT, X3F_HUFF_LUT_BITS);
 
-  for (color = 0; color < 3; color++) {
-    true_decode_one_color(ID, color);
-  }
+  populate_huff_lut(LUT, table, X3F_HUFF_LUT_BITS, tree, 0, 0, 0);
 }
 
-/* Decode use the huffman tree */
+/* Resolves up to X3F_HUFF_LUT_BITS (or X3F_HUFF_LUT_SUB_BITS) bits
+   of the code per lookup */
 
-static int32_t get_huffman_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
+static int32_t get_huffman_diff_lut(bit_state_t *BS, x3f_huff_lut_t *LUT)
 {
-  int32_t diff;
-  x3f_huffnode_t *node = &HTP->nodes[0];
+  x3f_huff_lut_entry_t *e;
 
-  while (node->branch[0] != NULL || node->branch[1] != NULL) {
-    uint8_t bit = get_bit(BS);
-    x3f_huffnode_t *new_node = node->branch[bit];
+  fill_bits(BS);
+  e = &LUT->entry[peek_bits(BS, X3F_HUFF_LUT_BITS)];
 
-    node = new_node;
-    if (node == NULL) {
-      /* TODO: Shouldn't this be treated as a fatal error? */
-      x3f_printf(ERR, "Huffman coding got unexpected bit\n");
-      return 0;
-    }
+  while (e->sub_bits != 0) {
+    consume_bits(BS, e->length);
+    e = &LUT->entry[e->value + peek_bits(BS, e->sub_bits)];
   }
 
-  diff = node->leaf;
+  consume_bits(BS, e->length);
 
-  return diff;
+  if (e->invalid) {
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Huffman coding got unexpected bit\n");
+    return 0;
+  }
+
+  return e->value;
 }
 
+/* The rows are decoded into signed values, before any offset is
+   added and negative values are clipped. The running values are 16
+   bit and wrap around, so adding the offset afterwards gives exactly
+   the same result as starting the row with it.
+
+   All columns of the row are decoded, as each value depends on the
+   one to the left of it, but only columns left to right are stored
+   in dst. dst is NULL if the row is only decoded for its minimum.
+
+   If sum is not NULL, the values are instead added to the sums of
+   the bins of the row. With automatic offset no value is clipped, as
+   the offset lifts the minimum to zero, so the offset is added to the
+   sums afterwards. Otherwise, the values are clipped already here. */
+
 static void huffman_decode_row(x3f_info_t *I,
                                x3f_directory_entry_t *DE,
                                int bits,
                                int row,
                                int offset,
+                               uint32_t left,
+                               uint32_t right,
+                               int16_t *dst,
+                               int32_t *sum,
+                               uint32_t bin,
                                int *minimum)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
@@ -942,153 +2576,639 @@ static void huffman_decode_row(x3f_info_t *I,
   x3f_huffman_t *HUF = ID->huffman;
 
   int16_t c[3] = {offset,offset,offset};
-  int col;
+  uint32_t bin_col = 0;
+  uint32_t col;
   bit_state_t BS;
 
-  set_bit_state(&BS, ID->data + HUF->row_offsets.element[row]);
+  set_bit_state(&BS, ID->data + HUF->row_offsets.element[row],
+		(uint8_t *)ID->data + ID->data_size);
 
   for (col = 0; col < ID->columns; col++) {
+    int16_t *out =
+      dst != NULL && col >= left && col <= right ? dst + 3*(col - left) : NULL;
     int color;
 
     for (color = 0; color < 3; color++) {
-      uint16_t c_fix;
+      c[color] += get_huffman_diff_lut(&BS, &HUF->lut);
+      if (c[color] < *minimum)
+	*minimum = c[color];
+
+      if (out != NULL)
+	out[color] = c[color];
+      else if (sum != NULL)
+	sum[color] += auto_legacy_offset || c[color] > 0 ? c[color] : 0;
+    }
 
-      c[color] += get_huffman_diff(&BS, &HUF->tree);
-      if (c[color] < 0) {
-        c_fix = 0;
-        if (c[color] < *minimum)
-          *minimum = c[color];
-      } else {
-        c_fix = c[color];
+    if (sum != NULL && ++bin_col == bin) {
+      sum += 3;
+      bin_col = 0;
+    }
+  }
+}
+
+/* Every row starts at its own offset in the data, so the rows are
+   decoded in parallel, in bands of HUFFMAN_BAND_ROWS rows. Each band
+   keeps its own minimum, which are reduced when all are ready. If
+   binned, the bands are made a multiple of the bin size, so that
+   each band has bins of its own.
+
+   Only the rows and columns in the window are stored, and decoded
+   is only as big as the window. The rows below it are not decoded.
+   With automatic offset, the rows above and below it are still
+   decoded, as the offset depends on the minimum of the whole
+   image. */
+
+#define HUFFMAN_BAND_ROWS 16
+
+typedef struct huffman_band_job_s {
+  x3f_info_t *I;
+  x3f_directory_entry_t *DE;
+  int bits;
+  int offset;
+  uint32_t bin;			/* Bin size, 1 if not binned */
+  uint32_t window[4];		/* Left, top, right, bottom, inclusive */
+  uint32_t first_row;		/* First row to decode */
+  uint32_t end_row;		/* Last row to decode + 1 */
+  int band_rows;
+  int16_t *decoded;		/* Signed 3x16 bit values */
+  int32_t *sums;		/* Sums of the bins, if binned */
+  int *minimum;			/* One per band */
+  int16_t fix_offset;		/* Added in the fix up */
+} huffman_band_job_t;
+
+static void huffman_decode_band(void *ctx, int band)
+{
+  huffman_band_job_t *job = (huffman_band_job_t *)ctx;
+  x3f_image_data_t *ID = &job->DE->header.data_subsection.image_data;
+  uint32_t bin = job->bin;
+  uint32_t width = job->window[2] - job->window[0] + 1;
+  uint32_t row = job->first_row + band*job->band_rows;
+  uint32_t end = row + job->band_rows;
+  int minimum = 0;
+
+  if (end > job->end_row) end = job->end_row;
+
+  for (; row < end; row++) {
+    int32_t *sum = job->sums == NULL ? NULL :
+      job->sums + 3*bin_count(ID->columns, bin)*(row/bin);
+    int16_t *dst = job->decoded != NULL &&
+      row >= job->window[1] && row <= job->window[3] ?
+      job->decoded + 3*width*(row - job->window[1]) : NULL;
+
+    huffman_decode_row(job->I, job->DE, job->bits, row, job->offset,
+		       job->window[0], job->window[2], dst, sum, bin,
+		       &minimum);
+  }
+
+  job->minimum[band] = minimum;
+}
+
+/* Add the final offset to the mean of each bin, clip negative values
+   and store in the destination area */
+
+static void huffman_fix_bins(huffman_band_job_t *job, int band)
+{
+  x3f_image_data_t *ID = &job->DE->header.data_subsection.image_data;
+  x3f_huffman_t *HUF = ID->huffman;
+  uint32_t bin = job->bin;
+  uint32_t columns = bin_count(ID->columns, bin);
+  uint32_t row = band*job->band_rows/bin;
+  uint32_t end = row + job->band_rows/bin;
+
+  if (end > bin_count(ID->rows, bin)) end = bin_count(ID->rows, bin);
+
+  for (; row < end; row++) {
+    uint32_t bin_rows = ID->rows - row*bin < bin ? ID->rows - row*bin : bin;
+    uint32_t col;
+
+    for (col = 0; col < columns; col++) {
+      uint32_t bin_cols =
+	ID->columns - col*bin < bin ? ID->columns - col*bin : bin;
+      int32_t n = bin_cols*bin_rows;
+      uint32_t i = 3*(row*columns + col);
+      int color;
+
+      for (color = 0; color < 3; color++) {
+	int32_t c = job->sums[i + color] + n*job->fix_offset;
+
+	c = c < 0 ? 0 : (c + n/2) / n;
+	if (ID->planar) {
+	  x3f_area16_t *plane = &HUF->plane16[color];
+
+	  plane->data[row*plane->row_stride + col] = (uint16_t)c;
+	} else if (HUF->x3rgb16.data != NULL)
+	  HUF->x3rgb16.data[i + color] = (uint16_t)c;
+	else
+	  HUF->rgb8.data[i + color] = (uint8_t)c;
       }
+    }
+  }
+}
+
+/* Add the final offset, clip negative values and store in the
+   destination area. NOTE: for 16 bit RAW the destination is the same
+   memory as job->decoded. */
+
+static void huffman_fix_band(void *ctx, int band)
+{
+  huffman_band_job_t *job = (huffman_band_job_t *)ctx;
+  x3f_image_data_t *ID = &job->DE->header.data_subsection.image_data;
+  x3f_huffman_t *HUF = ID->huffman;
+  uint32_t top = job->window[1];
+  uint32_t width = job->window[2] - job->window[0] + 1;
+  uint32_t row = job->first_row + band*job->band_rows;
+  uint32_t end = row + job->band_rows;
+  uint32_t i, first, last;
+
+  if (job->sums != NULL) {
+    huffman_fix_bins(job, band);
+    return;
+  }
+
+  /* Only the part of the band within the window, in its rows */
+  if (end > job->window[3] + 1) end = job->window[3] + 1;
+  if (row < top) row = top;
+  if (row >= end) return;
+  row -= top;
+  end -= top;
 
-      switch (ID->type_format) {
-      case X3F_IMAGE_RAW_HUFFMAN_X530:
-      case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-        HUF->x3rgb16.data[3*(row*ID->columns + col) + color] = (uint16_t)c_fix;
-        break;
-      case X3F_IMAGE_THUMB_HUFFMAN:
-        HUF->rgb8.data[3*(row*ID->columns + col) + color] = (uint8_t)c_fix;
-        break;
-      default:
-	/* TODO: Shouldn't this be treated as a fatal error? */
-        x3f_printf(ERR, "Unknown huffman image type\n");
+  first = 3*row*width;
+  last = 3*end*width;
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+    if (ID->planar) {
+      for (; row < end; row++) {
+	int color;
+
+	for (color = 0; color < 3; color++) {
+	  x3f_area16_t *plane = &HUF->plane16[color];
+	  int16_t *src = &job->decoded[3*row*width + color];
+	  uint16_t *dst = &plane->data[row*plane->row_stride];
+	  uint32_t col;
+
+	  for (col = 0; col < width; col++) {
+	    int16_t c = src[3*col] + job->fix_offset;
+
+	    dst[col] = c < 0 ? 0 : (uint16_t)c;
+	  }
+	}
       }
+      break;
+    }
+    for (i = first; i < last; i++) {
+      int16_t c = job->decoded[i] + job->fix_offset;
+
+      HUF->x3rgb16.data[i] = c < 0 ? 0 : (uint16_t)c;
+    }
+    break;
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    for (i = first; i < last; i++) {
+      int16_t c = job->decoded[i] + job->fix_offset;
+
+      HUF->rgb8.data[i] = c < 0 ? 0 : (uint8_t)c;
     }
+    break;
   }
 }
 
 static void huffman_decode(x3f_info_t *I,
                            x3f_directory_entry_t *DE,
-                           int bits)
+                           int bits,
+                           const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  x3f_huffman_t *HUF = ID->huffman;
 
-  int row;
+  uint32_t bin = req->bin;
+  int band_rows = bin_count(HUFFMAN_BAND_ROWS, bin)*bin;
   int minimum = 0;
-  int offset = legacy_offset;
+  int band, bands, in_place;
+  uint32_t width, height;
+  huffman_band_job_t job;
+
+  /* Huffman images are not binned within a region of interest */
+  assert(req->rect == NULL || bin == 1);
+
+  job.I = I;
+  job.DE = DE;
+  job.bits = bits;
+  job.offset = legacy_offset;
+  job.bin = bin;
+  job.band_rows = band_rows;
+  job.decoded = NULL;
+  job.sums = NULL;
+
+  if (req->rect != NULL)
+    memcpy(job.window, req->rect, sizeof(job.window));
+  else {
+    job.window[0] = 0;
+    job.window[1] = 0;
+    job.window[2] = ID->columns - 1;
+    job.window[3] = ID->rows - 1;
+  }
+  width = job.window[2] - job.window[0] + 1;
+  height = job.window[3] - job.window[1] + 1;
+
+  if (auto_legacy_offset) {
+    job.first_row = 0;
+    job.end_row = ID->rows;
+  } else {
+    job.first_row = job.window[1];
+    job.end_row = job.window[3] + 1;
+  }
+  bands = (job.end_row - job.first_row + band_rows - 1) / band_rows;
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    break;
+  default:
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Unknown huffman image type\n");
+    return;
+  }
+
+  if (bin > 1)
+    job.sums = (int32_t *)
+      calloc(3*bin_count(ID->rows, bin)*bin_count(ID->columns, bin),
+	     sizeof(int32_t));
+  else if (ID->type_format == X3F_IMAGE_THUMB_HUFFMAN || ID->planar)
+    job.decoded = (int16_t *)malloc(3*height*width*sizeof(int16_t));
+  else
+    /* Decode in place */
+    job.decoded = (int16_t *)HUF->x3rgb16.data;
+
+  job.minimum = (int *)malloc(bands*sizeof(int));
 
-  x3f_printf(DEBUG, "Huffman decode with offset: %d\n", offset);
-  for (row = 0; row < ID->rows; row++)
-    huffman_decode_row(I, DE, bits, row, offset, &minimum);
+  x3f_printf(DEBUG, "Huffman decode with offset: %d\n", job.offset);
+  x3f_parallel_for(bands, huffman_decode_band, &job);
 
+  for (band = 0; band < bands; band++)
+    if (job.minimum[band] < minimum)
+      minimum = job.minimum[band];
+
+  /* Instead of decoding again with the offset -minimum, the
+     difference is added in the fix up */
   if (auto_legacy_offset && minimum < 0) {
-    offset = -minimum;
-    x3f_printf(DEBUG, "Redo with offset: %d\n", offset);
-    for (row = 0; row < ID->rows; row++)
-      huffman_decode_row(I, DE, bits, row, offset, &minimum);
+    x3f_printf(DEBUG, "Fix up with offset: %d\n", -minimum);
+    job.fix_offset = -minimum - job.offset;
+  } else
+    job.fix_offset = 0;
+
+  in_place =
+    job.decoded != NULL && (void *)job.decoded == (void *)HUF->x3rgb16.data;
+
+  /* Without negative values, 16 bit RAW is already final */
+  if (minimum < 0 || !in_place)
+    x3f_parallel_for(bands, huffman_fix_band, &job);
+
+  if (!in_place)
+    free(job.decoded);
+  free(job.sums);
+  free(job.minimum);
+}
+
+/* The not compressed rows are decoded by kernels specialized for
+   each combination of bits per color, use of mapping table and
+   output type. The kernel is chosen once per image, so the inner
+   loop has no switches left. A value is clipped to zero if it is
+   negative when seen as a signed value of the output size. */
+
+typedef void (*simple_decode_row_t)(const uint32_t *data,
+				    const uint16_t *mapping,
+				    void *dst,
+				    int columns);
+
+#define SIMPLE_DECODE_ROW(NAME, BITS, MAPPED, TYPE, STYPE)		\
+  static void NAME(const uint32_t *data,				\
+		   const uint16_t *mapping,				\
+		   void *dst,						\
+		   int columns)						\
+  {									\
+    const uint32_t mask = (1<<(BITS)) - 1;				\
+    TYPE *out = (TYPE *)dst;						\
+    uint16_t c0 = 0, c1 = 0, c2 = 0;					\
+    int col;								\
+									\
+    for (col = 0; col < columns; col++) {				\
+      uint32_t val = data[col];						\
+      uint32_t d0 = val & mask;						\
+      uint32_t d1 = (val>>(BITS)) & mask;				\
+      uint32_t d2 = (val>>(2*(BITS))) & mask;				\
+									\
+      if (MAPPED) {							\
+	d0 = mapping[d0];						\
+	d1 = mapping[d1];						\
+	d2 = mapping[d2];						\
+      }									\
+									\
+      c0 += d0;								\
+      c1 += d1;								\
+      c2 += d2;								\
+									\
+      out[0] = (STYPE)c0 > 0 ? (TYPE)c0 : 0;				\
+      out[1] = (STYPE)c1 > 0 ? (TYPE)c1 : 0;				\
+      out[2] = (STYPE)c2 > 0 ? (TYPE)c2 : 0;				\
+      out += 3;								\
+    }									\
+  }
+
+#define SIMPLE_DECODE_ROWS(BITS)					\
+  SIMPLE_DECODE_ROW(simple_decode_row_raw_##BITS, BITS, 0,		\
+		    uint16_t, int16_t)					\
+  SIMPLE_DECODE_ROW(simple_decode_row_raw_map_##BITS, BITS, 1,		\
+		    uint16_t, int16_t)					\
+  SIMPLE_DECODE_ROW(simple_decode_row_thumb_##BITS, BITS, 0,		\
+		    uint8_t, int8_t)					\
+  SIMPLE_DECODE_ROW(simple_decode_row_thumb_map_##BITS, BITS, 1,	\
+		    uint8_t, int8_t)
+
+SIMPLE_DECODE_ROWS(8)
+SIMPLE_DECODE_ROWS(9)
+SIMPLE_DECODE_ROWS(10)
+SIMPLE_DECODE_ROWS(11)
+SIMPLE_DECODE_ROWS(12)
+
+#define SIMPLE_DECODE_MIN_BITS 8
+#define SIMPLE_DECODE_MAX_BITS 12
+
+/* Indexed by [thumbnail][mapped][bits - SIMPLE_DECODE_MIN_BITS] */
+static const simple_decode_row_t
+simple_decode_rows[2][2][SIMPLE_DECODE_MAX_BITS-SIMPLE_DECODE_MIN_BITS+1] = {
+  {
+    {simple_decode_row_raw_8, simple_decode_row_raw_9,
+     simple_decode_row_raw_10, simple_decode_row_raw_11,
+     simple_decode_row_raw_12},
+    {simple_decode_row_raw_map_8, simple_decode_row_raw_map_9,
+     simple_decode_row_raw_map_10, simple_decode_row_raw_map_11,
+     simple_decode_row_raw_map_12},
+  },
+  {
+    {simple_decode_row_thumb_8, simple_decode_row_thumb_9,
+     simple_decode_row_thumb_10, simple_decode_row_thumb_11,
+     simple_decode_row_thumb_12},
+    {simple_decode_row_thumb_map_8, simple_decode_row_thumb_map_9,
+     simple_decode_row_thumb_map_10, simple_decode_row_thumb_map_11,
+     simple_decode_row_thumb_map_12},
+  },
+};
+
+#ifdef SIMPLE_DECODE_AVX2
+
+/* AVX2 version of the kernels above, decoding eight pixels at a
+   time. The three fields are unpacked with shifts, mapped with a
+   gather from a 32 bit copy of the mapping table and summed with a
+   parallel prefix sum per color. The sums are kept in 32 bit, only
+   the lower bits matter. It is only used if the CPU supports AVX2,
+   which is checked at run time. */
+
+/* Interleave eight clipped pixels, four per 128 bit lane, as RGB */
+
+__attribute__((target("avx2")))
+static inline void simple_store_raw_avx2(uint16_t *out,
+					 __m256i r, __m256i g, __m256i b)
+{
+  const __m128i rg_shuffle =
+    _mm_setr_epi8(0,1, 8,9, -1,-1, 2,3, 10,11, -1,-1, 4,5, 12,13);
+  const __m128i b_shuffle =
+    _mm_setr_epi8(-1,-1, -1,-1, 0,1, -1,-1, -1,-1, 2,3, -1,-1, -1,-1);
+  const __m128i rg_shuffle_tail =
+    _mm_setr_epi8(-1,-1, 6,7, 14,15, -1,-1, -1,-1, -1,-1, -1,-1, -1,-1);
+  const __m128i b_shuffle_tail =
+    _mm_setr_epi8(4,5, -1,-1, -1,-1, 6,7, -1,-1, -1,-1, -1,-1, -1,-1);
+  __m256i rg = _mm256_packus_epi32(r, g); /* r0-3 g0-3 | r4-7 g4-7 */
+  __m256i bb = _mm256_packus_epi32(b, b); /* b0-3 b0-3 | b4-7 b4-7 */
+  int lane;
+
+  for (lane = 0; lane < 2; lane++) {
+    __m128i rg_l = lane ?
+      _mm256_extracti128_si256(rg, 1) : _mm256_castsi256_si128(rg);
+    __m128i b_l = lane ?
+      _mm256_extracti128_si256(bb, 1) : _mm256_castsi256_si128(bb);
+    __m128i head = _mm_or_si128(_mm_shuffle_epi8(rg_l, rg_shuffle),
+				_mm_shuffle_epi8(b_l, b_shuffle));
+    __m128i tail = _mm_or_si128(_mm_shuffle_epi8(rg_l, rg_shuffle_tail),
+				_mm_shuffle_epi8(b_l, b_shuffle_tail));
+
+    _mm_storeu_si128((__m128i *)out, head);
+    _mm_storel_epi64((__m128i *)(out + 8), tail);
+    out += 12;
   }
 }
 
-static int32_t get_simple_diff(x3f_huffman_t *HUF, uint16_t index)
+__attribute__((target("avx2")))
+static inline void simple_store_thumb_avx2(uint8_t *out,
+					   __m256i r, __m256i g, __m256i b)
 {
-  if (HUF->mapping.size == 0)
-    return index;
-  else
-    return HUF->mapping.element[index];
+  const __m128i rgb_shuffle =
+    _mm_setr_epi8(0,4,8, 1,5,9, 2,6,10, 3,7,11, -1,-1,-1,-1);
+  __m256i rg = _mm256_packus_epi32(r, g);
+  __m256i bb = _mm256_packus_epi32(b, b);
+  /* r0-3 g0-3 b0-3 b0-3 | r4-7 g4-7 b4-7 b4-7 */
+  __m256i rgb = _mm256_packus_epi16(rg, bb);
+  __m128i lo =
+    _mm_shuffle_epi8(_mm256_castsi256_si128(rgb), rgb_shuffle);
+  __m128i hi =
+    _mm_shuffle_epi8(_mm256_extracti128_si256(rgb, 1), rgb_shuffle);
+
+  uint32_t lo_tail = (uint32_t)_mm_extract_epi32(lo, 2);
+  uint32_t hi_tail = (uint32_t)_mm_extract_epi32(hi, 2);
+
+  _mm_storel_epi64((__m128i *)out, lo);
+  memcpy(out + 8, &lo_tail, 4);
+  _mm_storel_epi64((__m128i *)(out + 12), hi);
+  memcpy(out + 20, &hi_tail, 4);
+}
+
+#define SIMPLE_DECODE_ROW_AVX2(NAME, TYPE, STYPE, SIGN_SHIFT, STORE)	\
+  __attribute__((target("avx2")))					\
+  static void NAME(const uint32_t *data,				\
+		   const int32_t *mapping32,				\
+		   void *dst,						\
+		   int columns,						\
+		   int bits)						\
+  {									\
+    const uint32_t mask = (1<<bits) - 1;				\
+    const __m256i vmask = _mm256_set1_epi32(mask);			\
+    const __m256i last = _mm256_set1_epi32(7);				\
+    const __m256i zero = _mm256_setzero_si256();			\
+    __m256i sum[3] = {zero, zero, zero};				\
+    __m256i clipped[3];							\
+    TYPE *out = (TYPE *)dst;						\
+    uint16_t c[3];							\
+    int col, color;							\
+									\
+    for (col = 0; col + 8 <= columns; col += 8) {			\
+      __m256i val = _mm256_loadu_si256((const __m256i *)(data + col));	\
+									\
+      for (color = 0; color < 3; color++) {				\
+	__m128i shift = _mm_cvtsi32_si128(color*bits);			\
+	__m256i d = _mm256_and_si256(_mm256_srl_epi32(val, shift), vmask); \
+	__m256i t;							\
+									\
+	if (mapping32)							\
+	  d = _mm256_i32gather_epi32((const int *)mapping32, d, 4);	\
+									\
+	/* Prefix sum within each 128 bit lane ... */			\
+	d = _mm256_add_epi32(d, _mm256_slli_si256(d, 4));		\
+	d = _mm256_add_epi32(d, _mm256_slli_si256(d, 8));		\
+	/* ... then carry the low lane into the high lane */		\
+	t = _mm256_shuffle_epi32(d, 0xff);				\
+	d = _mm256_add_epi32(d, _mm256_permute2x128_si256(t, t, 0x08));	\
+	d = _mm256_add_epi32(d, sum[color]);				\
+	sum[color] = _mm256_permutevar8x32_epi32(d, last);		\
+									\
+	/* Clip values that are negative as STYPE */			\
+	d = _mm256_srai_epi32(_mm256_slli_epi32(d, SIGN_SHIFT), SIGN_SHIFT); \
+	clipped[color] = _mm256_max_epi32(d, zero);			\
+      }									\
+									\
+      STORE(out, clipped[0], clipped[1], clipped[2]);			\
+      out += 24;							\
+    }									\
+									\
+    /* The remaining pixels, if any */					\
+    for (color = 0; color < 3; color++)				\
+      c[color] = (uint16_t)_mm256_cvtsi256_si32(sum[color]);		\
+									\
+    for (; col < columns; col++) {					\
+      uint32_t val = data[col];						\
+									\
+      for (color = 0; color < 3; color++) {				\
+	uint32_t d = (val>>(color*bits)) & mask;			\
+									\
+	c[color] += mapping32 ? mapping32[d] : d;			\
+	*out++ = (STYPE)c[color] > 0 ? (TYPE)c[color] : 0;		\
+      }									\
+    }									\
+  }
+
+SIMPLE_DECODE_ROW_AVX2(simple_decode_row_raw_avx2,
+		       uint16_t, int16_t, 16, simple_store_raw_avx2)
+SIMPLE_DECODE_ROW_AVX2(simple_decode_row_thumb_avx2,
+		       uint8_t, int8_t, 24, simple_store_thumb_avx2)
+
+static int simple_decode_has_avx2(void)
+{
+  static int has_avx2 = -1;
+
+  if (has_avx2 == -1) {
+    __builtin_cpu_init();
+    has_avx2 = __builtin_cpu_supports("avx2") != 0;
+  }
+
+  return has_avx2;
 }
 
-static void simple_decode_row(x3f_info_t *I,
-                              x3f_directory_entry_t *DE,
-                              int bits,
-                              int row,
-                              int row_stride)
+#endif /* SIMPLE_DECODE_AVX2 */
+
+/* Only the rows in the region of interest are decoded. If it does
+   not span all columns, each row is decoded into row_buf and the
+   columns within it copied from there. Nothing is decoded if the
+   type or number of bits is not supported, which is an error. */
+
+static x3f_return_t simple_decode(x3f_info_t *I,
+                          x3f_directory_entry_t *DE,
+                          int bits,
+                          int row_stride,
+                          const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
   x3f_huffman_t *HUF = ID->huffman;
 
-  uint32_t *data = (uint32_t *)(ID->data + row*row_stride);
-
-  uint16_t c[3] = {0,0,0};
-  int col;
-
-  uint32_t mask = 0;
+  simple_decode_row_t decode_row;
+  int thumbnail, mapped;
+  uint8_t *dst, *row_buf;
+  int pixel_size, dst_row_size;
+  uint32_t left = 0, top = 0, rows = ID->rows, columns = ID->columns;
+  uint32_t row;
+#ifdef SIMPLE_DECODE_AVX2
+  int use_avx2 = simple_decode_has_avx2();
+  int32_t *mapping32 = NULL;
+#endif
 
-  switch (bits) {
-  case 8:
-    mask = 0x0ff;
-    break;
-  case 9:
-    mask = 0x1ff;
-    break;
-  case 10:
-    mask = 0x3ff;
-    break;
-  case 11:
-    mask = 0x7ff;
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+    thumbnail = 0;
+    dst = (uint8_t *)HUF->x3rgb16.data;
+    pixel_size = 3*sizeof(uint16_t);
     break;
-  case 12:
-    mask = 0xfff;
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    thumbnail = 1;
+    dst = HUF->rgb8.data;
+    pixel_size = 3*sizeof(uint8_t);
     break;
   default:
-    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Unknown huffman image type\n");
+    return X3F_INTERNAL_ERROR;
+  }
+
+  if (bits < SIMPLE_DECODE_MIN_BITS || bits > SIMPLE_DECODE_MAX_BITS) {
     x3f_printf(ERR, "Unknown number of bits: %d\n", bits);
-    mask = 0;
-    break;
+    return X3F_INTERNAL_ERROR;
   }
 
-  for (col = 0; col < ID->columns; col++) {
-    int color;
-    uint32_t val = data[col];
+  if (req->rect != NULL) {
+    left = req->rect[0];
+    top = req->rect[1];
+    columns = req->rect[2] - left + 1;
+    rows = req->rect[3] - top + 1;
+  }
+  dst_row_size = columns*pixel_size;
+  row_buf = columns != ID->columns ?
+    (uint8_t *)malloc(ID->columns*pixel_size) : NULL;
 
-    for (color = 0; color < 3; color++) {
-      uint16_t c_fix;
-      c[color] += get_simple_diff(HUF, (val>>(color*bits))&mask);
-
-      switch (ID->type_format) {
-      case X3F_IMAGE_RAW_HUFFMAN_X530:
-      case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-        c_fix = (int16_t)c[color] > 0 ? c[color] : 0;
-
-        HUF->x3rgb16.data[3*(row*ID->columns + col) + color] = c_fix;
-        break;
-      case X3F_IMAGE_THUMB_HUFFMAN:
-        c_fix = (int8_t)c[color] > 0 ? c[color] : 0;
-
-        HUF->rgb8.data[3*(row*ID->columns + col) + color] = c_fix;
-        break;
-      default:
-	/* TODO: Shouldn't this be treated as a fatal error? */
-        x3f_printf(ERR, "Unknown huffman image type\n");
-      }
+  mapped = HUF->mapping.size != 0;
+  decode_row =
+    simple_decode_rows[thumbnail][mapped][bits - SIMPLE_DECODE_MIN_BITS];
+
+#ifdef SIMPLE_DECODE_AVX2
+  if (use_avx2) {
+    x3f_printf(DEBUG, "Simple decode using AVX2\n");
+
+    if (mapped) {
+      uint32_t i, size = 1<<bits;
+
+      /* Indices not in the mapping table map to zero */
+      mapping32 = (int32_t *)calloc(size, sizeof(int32_t));
+      for (i = 0; i < size && i < HUF->mapping.size; i++)
+	mapping32[i] = HUF->mapping.element[i];
     }
   }
-}
+#endif
 
-static void simple_decode(x3f_info_t *I,
-                          x3f_directory_entry_t *DE,
-                          int bits,
-                          int row_stride)
-{
-  x3f_directory_entry_header_t *DEH = &DE->header;
-  x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  for (row = 0; row < rows; row++) {
+    uint32_t *data =
+      (uint32_t *)((uint8_t *)ID->data + (top + row)*row_stride);
+    uint8_t *out = row_buf != NULL ? row_buf : dst + row*dst_row_size;
+
+#ifdef SIMPLE_DECODE_AVX2
+    if (use_avx2) {
+      if (thumbnail)
+	simple_decode_row_thumb_avx2(data, mapping32, out, ID->columns, bits);
+      else
+	simple_decode_row_raw_avx2(data, mapping32, out, ID->columns, bits);
+    } else
+#endif
+      decode_row(data, HUF->mapping.element, out, ID->columns);
 
-  int row;
+    if (row_buf != NULL)
+      memcpy(dst + row*dst_row_size, row_buf + left*pixel_size,
+	     dst_row_size);
+  }
 
-  for (row = 0; row < ID->rows; row++)
-    simple_decode_row(I, DE, bits, row, row_stride);
+#ifdef SIMPLE_DECODE_AVX2
+  free(mapping32);
+#endif
+  free(row_buf);
+
+  return X3F_OK;
 }
 
 /* --------------------------------------------------------------------- */
@@ -1103,7 +3223,7 @@ static void read_data_set_offset(x3f_info_t *I,
 {
   uint32_t i_off = DE->input.offset + header_size;
 
-  fseek(I->input.file, i_off, SEEK_SET);
+  input_seek(I, i_off, SEEK_SET);
 }
 
 /* ... then you read the data, block for block */
@@ -1113,8 +3233,18 @@ static uint32_t read_data_block(void **data,
                                 x3f_directory_entry_t *DE,
                                 uint32_t footer)
 {
-  uint32_t size =
-    DE->input.size + DE->input.offset - ftell(I->input.file) - footer;
+  long pos = input_tell(I);
+  uint32_t size = DE->input.size + DE->input.offset - pos - footer;
+
+  map_input(I);
+
+  if (I->memory.data != NULL && pos + (size_t)size <= I->memory.size) {
+    /* Zero copy, just skip the data in the file */
+    *data = (void *)(I->memory.data + pos);
+    advise_sequential(I, *data, size);
+    input_seek(I, size, SEEK_CUR);
+    return size;
+  }
 
   *data = (void *)malloc(size);
 
@@ -1134,20 +3264,20 @@ static void x3f_load_image_verbatim(x3f_info_t *I, x3f_directory_entry_t *DE)
 }
 
 #if defined(_WIN32) || defined (_WIN64)
-static char *utf16le_to_utf8(utf16_t *str)
+static char *utf16le_to_utf8(x3f_arena_t *A, utf16_t *str)
 {
   size_t osize = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
-  char *buf = malloc(osize);
+  char *buf = (char *)arena_alloc(A, osize);
 
   WideCharToMultiByte(CP_UTF8, 0, str, -1, buf, osize, NULL, NULL);
 
   return buf;
 }
 #else
-static char *utf16le_to_utf8(utf16_t *str)
+static char *utf16le_to_utf8(x3f_arena_t *A, utf16_t *str)
 {
   iconv_t ic = iconv_open("UTF-8", "UTF-16LE");
-  size_t isize, osize;
+  size_t isize, osize, bufsize;
   char *buf, *ibuf, *obuf;
 
   assert(ic != (iconv_t)-1);
@@ -1155,8 +3285,9 @@ static char *utf16le_to_utf8(utf16_t *str)
   for (isize=0; str[isize]; isize++);
   isize *= 2;			/* Size in bytes */
   osize = 2*isize;		/* Worst case scenario */
+  bufsize = osize+1;
 
-  buf = malloc(osize+1);
+  buf = (char *)arena_alloc(A, bufsize);
   ibuf = (char *)str;
   obuf = buf;
 
@@ -1165,7 +3296,9 @@ static char *utf16le_to_utf8(utf16_t *str)
 
   iconv_close(ic);
 
-  return realloc(buf, obuf-buf+1);
+  arena_shrink(A, buf, bufsize, obuf-buf+1);
+
+  return buf;
 }
 #endif
 
@@ -1186,13 +3319,18 @@ static void x3f_load_property_list(x3f_info_t *I, x3f_directory_entry_t *DE)
 
     P->name = ((utf16_t *)PL->data + P->name_offset);
     P->value = ((utf16_t *)PL->data + P->value_offset);
-    P->name_utf8 = utf16le_to_utf8(P->name);
-    P->value_utf8 = utf16le_to_utf8(P->value);
+    P->name_utf8 = utf16le_to_utf8(&I->arena, P->name);
+    P->value_utf8 = utf16le_to_utf8(&I->arena, P->value);
   }
+
+  new_name_index(&I->arena, &PL->property_index, PL->property_table.element,
+		 sizeof(x3f_property_t), offsetof(x3f_property_t, name_utf8),
+		 PL->num_properties);
 }
 
 static void x3f_load_true(x3f_info_t *I,
-			  x3f_directory_entry_t *DE)
+			  x3f_directory_entry_t *DE,
+			  const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
@@ -1200,6 +3338,8 @@ static void x3f_load_true(x3f_info_t *I,
   x3f_quattro_t *Q = NULL;
   int i;
 
+  ID->planar = use_planar;
+
   if (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
       ID->type_format == X3F_IMAGE_RAW_SDQ ||
       ID->type_format == X3F_IMAGE_RAW_SDQH) {
@@ -1247,72 +3387,122 @@ static void x3f_load_true(x3f_info_t *I,
   /* Read image data */
   ID->data_size = read_data_block(&ID->data, I, DE, 0);
 
-  /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
-  new_huffman_tree(&TRU->tree, 8);
+  TRU->cached =
+    table_cache_get(TABLE_CACHE_TRUE, (uint8_t *)TRU->table.element,
+		    TRU->table.size*sizeof(x3f_true_huffman_element_t));
+
+  if (TRU->cached == NULL) {
+    /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
+    new_huffman_tree(&TRU->tree, 8);
 
-  populate_true_huffman_tree(&TRU->tree, &TRU->table);
+    populate_true_huffman_tree(&TRU->tree, &TRU->table);
 
 #ifdef DBG_PRNT
-  print_huffman_tree(TRU->tree.nodes, 0, 0);
+    print_huffman_tree(&TRU->tree, 0, 0, 0);
 #endif
 
+    new_true_lut(&TRU->lut);
+    populate_true_lut(&TRU->lut, &TRU->tree, 0, 0, 0);
+
+    TRU->cached =
+      table_cache_put(TABLE_CACHE_TRUE, (uint8_t *)TRU->table.element,
+		      TRU->table.size*sizeof(x3f_true_huffman_element_t),
+		      &TRU->tree, &TRU->lut, NULL);
+  }
+
+  if (TRU->cached != NULL) {
+    TRU->tree = TRU->cached->tree;
+    TRU->lut = TRU->cached->true_lut;
+  }
+
   TRU->plane_address[0] = ID->data;
   for (i=1; i<TRUE_PLANES; i++)
     TRU->plane_address[i] =
       TRU->plane_address[i-1] +
       (((TRU->plane_size.element[i-1] + 15) / 16) * 16);
 
+  /* The areas are only as big as the region of interest, or the
+     bins */
   if ( (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
 	ID->type_format == X3F_IMAGE_RAW_SDQ ||
 	ID->type_format == X3F_IMAGE_RAW_SDQH ) &&
        Q->quattro_layout) {
-    uint32_t columns = Q->plane[0].columns;
-    uint32_t rows = Q->plane[0].rows;
-    uint32_t channels = 3;
-    uint32_t size = columns * rows * channels;
-
-    TRU->x3rgb16.columns = columns;
-    TRU->x3rgb16.rows = rows;
-    TRU->x3rgb16.channels = channels;
-    TRU->x3rgb16.row_stride = columns * channels;
-    TRU->x3rgb16.data = TRU->x3rgb16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
+    uint32_t window[4];
+    uint32_t columns, rows, channels, size;
+
+    true_get_window(ID, req, 0, Q->plane[0].rows, Q->plane[0].columns,
+		    window);
+    columns = bin_count(window[2] - window[0] + 1, req->bin);
+    rows = bin_count(window[3] - window[1] + 1, req->bin);
+    channels = 3;
+    size = columns * rows * channels;
+
+    if (ID->planar)
+      /* Plane 2 is where the top layer is downsampled to */
+      new_planes(TRU->plane16, TRUE_PLANES, columns, rows);
+    else {
+      TRU->x3rgb16.columns = columns;
+      TRU->x3rgb16.rows = rows;
+      TRU->x3rgb16.channels = channels;
+      TRU->x3rgb16.row_stride = columns * channels;
+      TRU->x3rgb16.data = TRU->x3rgb16.buf =
+	(uint16_t *)malloc(sizeof(uint16_t)*size);
+    }
 
-    columns = Q->plane[2].columns;
-    rows = Q->plane[2].rows;
+    true_get_window(ID, req, 2, Q->plane[2].rows, Q->plane[2].columns,
+		    window);
+    columns = bin_count(window[2] - window[0] + 1, req->bin);
+    rows = bin_count(window[3] - window[1] + 1, req->bin);
     channels = 1;
     size = columns * rows * channels;
 
-    Q->top16.columns = columns;
-    Q->top16.rows = rows;
-    Q->top16.channels = channels;
-    Q->top16.row_stride = columns * channels;
-    Q->top16.data = Q->top16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
+    if (ID->planar)
+      new_planes(&Q->top16, 1, columns, rows);
+    else {
+      Q->top16.columns = columns;
+      Q->top16.rows = rows;
+      Q->top16.channels = channels;
+      Q->top16.row_stride = columns * channels;
+      Q->top16.data = Q->top16.buf =
+	(uint16_t *)malloc(sizeof(uint16_t)*size);
+    }
   } else {
-    uint32_t size = ID->columns * ID->rows * 3;
-
-    TRU->x3rgb16.columns = ID->columns;
-    TRU->x3rgb16.rows = ID->rows;
-    TRU->x3rgb16.channels = 3;
-    TRU->x3rgb16.row_stride = ID->columns * 3;
-    TRU->x3rgb16.data = TRU->x3rgb16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
+    uint32_t window[4];
+    uint32_t columns, rows, size;
+
+    true_get_window(ID, req, 0, ID->rows, ID->columns, window);
+    columns = bin_count(window[2] - window[0] + 1, req->bin);
+    rows = bin_count(window[3] - window[1] + 1, req->bin);
+    size = columns * rows * 3;
+
+    if (ID->planar)
+      new_planes(TRU->plane16, TRUE_PLANES, columns, rows);
+    else {
+      TRU->x3rgb16.columns = columns;
+      TRU->x3rgb16.rows = rows;
+      TRU->x3rgb16.channels = 3;
+      TRU->x3rgb16.row_stride = columns * 3;
+      TRU->x3rgb16.data = TRU->x3rgb16.buf =
+	(uint16_t *)malloc(sizeof(uint16_t)*size);
+    }
   }
 
-  true_decode(I, DE);
+  true_decode(I, DE, req);
 }
 
-static void x3f_load_huffman_compressed(x3f_info_t *I,
+static x3f_return_t x3f_load_huffman_compressed(x3f_info_t *I,
                                         x3f_directory_entry_t *DE,
                                         int bits,
-                                        int use_map_table)
+                                        int use_map_table,
+                                        const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
   x3f_huffman_t *HUF = ID->huffman;
   int table_size = 1<<bits;
   int row_offsets_size = ID->rows * sizeof(HUF->row_offsets.element[0]);
+  uint8_t *key;
+  size_t key_size;
 
   x3f_printf(DEBUG, "Load huffman compressed\n");
 
@@ -1322,23 +3512,50 @@ static void x3f_load_huffman_compressed(x3f_info_t *I,
 
   GET_TABLE(HUF->row_offsets, GET4, ID->rows);
 
-  x3f_printf(DEBUG, "Make huffman tree ...\n");
-  new_huffman_tree(&HUF->tree, bits);
-  populate_huffman_tree(&HUF->tree, &HUF->table, &HUF->mapping);
-  x3f_printf(DEBUG, "... DONE\n");
+  /* The values come from the mapping, if there is one */
+  key_size = HUF->table.size*sizeof(uint32_t) +
+    HUF->mapping.size*sizeof(uint16_t);
+  key = (uint8_t *)malloc(key_size);
+  memcpy(key, HUF->table.element, HUF->table.size*sizeof(uint32_t));
+  if (HUF->mapping.size != 0)
+    memcpy(key + HUF->table.size*sizeof(uint32_t), HUF->mapping.element,
+	   HUF->mapping.size*sizeof(uint16_t));
+
+  HUF->cached = table_cache_get(TABLE_CACHE_HUFFMAN, key, key_size);
+
+  if (HUF->cached == NULL) {
+    x3f_printf(DEBUG, "Make huffman tree ...\n");
+    new_huffman_tree(&HUF->tree, bits);
+    populate_huffman_tree(&HUF->tree, &HUF->table, &HUF->mapping);
+    new_huff_lut(&HUF->lut, &HUF->tree);
+    x3f_printf(DEBUG, "... DONE\n");
 
 #ifdef DBG_PRNT
-  print_huffman_tree(HUF->tree.nodes, 0, 0);
+    print_huffman_tree(&HUF->tree, 0, 0, 0);
 #endif
 
-  huffman_decode(I, DE, bits);
+    HUF->cached = table_cache_put(TABLE_CACHE_HUFFMAN, key, key_size,
+				  &HUF->tree, NULL, &HUF->lut);
+  }
+
+  if (HUF->cached != NULL) {
+    HUF->tree = HUF->cached->tree;
+    HUF->lut = HUF->cached->huff_lut;
+  }
+
+  free(key);
+
+  huffman_decode(I, DE, bits, req);
+
+  return X3F_OK;
 }
 
-static void x3f_load_huffman_not_compressed(x3f_info_t *I,
+static x3f_return_t x3f_load_huffman_not_compressed(x3f_info_t *I,
                                             x3f_directory_entry_t *DE,
                                             int bits,
                                             int use_map_table,
-                                            int row_stride)
+                                            int row_stride,
+                                            const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
@@ -1347,19 +3564,20 @@ static void x3f_load_huffman_not_compressed(x3f_info_t *I,
 
   ID->data_size = read_data_block(&ID->data, I, DE, 0);
 
-  simple_decode(I, DE, bits, row_stride);
+  return simple_decode(I, DE, bits, row_stride, req);
 }
 
-static void x3f_load_huffman(x3f_info_t *I,
+static x3f_return_t x3f_load_huffman(x3f_info_t *I,
                              x3f_directory_entry_t *DE,
                              int bits,
                              int use_map_table,
-                             int row_stride)
+                             int row_stride,
+                             const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
   x3f_huffman_t *HUF = new_huffman(&ID->huffman);
-  uint32_t size;
+  uint32_t columns = ID->columns, rows = ID->rows, size;
 
   if (use_map_table) {
     int table_size = 1<<bits;
@@ -1367,23 +3585,39 @@ static void x3f_load_huffman(x3f_info_t *I,
     GET_TABLE(HUF->mapping, GET2, table_size);
   }
 
+  /* The areas are only as big as the region of interest. Only
+     compressed images are binned, or made planar, while decoding. */
+  if (req->rect != NULL) {
+    columns = req->rect[2] - req->rect[0] + 1;
+    rows = req->rect[3] - req->rect[1] + 1;
+  } else if (row_stride == 0) {
+    columns = bin_count(columns, req->bin);
+    rows = bin_count(rows, req->bin);
+  }
+  ID->planar = use_planar && row_stride == 0 &&
+    ID->type_format != X3F_IMAGE_THUMB_HUFFMAN;
+
   switch (ID->type_format) {
   case X3F_IMAGE_RAW_HUFFMAN_X530:
   case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-    size = ID->columns * ID->rows * 3;
-    HUF->x3rgb16.columns = ID->columns;
-    HUF->x3rgb16.rows = ID->rows;
+    if (ID->planar) {
+      new_planes(HUF->plane16, 3, columns, rows);
+      break;
+    }
+    size = columns * rows * 3;
+    HUF->x3rgb16.columns = columns;
+    HUF->x3rgb16.rows = rows;
     HUF->x3rgb16.channels = 3;
-    HUF->x3rgb16.row_stride = ID->columns * 3;
+    HUF->x3rgb16.row_stride = columns * 3;
     HUF->x3rgb16.data = HUF->x3rgb16.buf =
       (uint16_t *)malloc(sizeof(uint16_t)*size);
     break;
   case X3F_IMAGE_THUMB_HUFFMAN:
-    size = ID->columns * ID->rows * 3;
-    HUF->rgb8.columns = ID->columns;
-    HUF->rgb8.columns = ID->rows;
+    size = columns * rows * 3;
+    HUF->rgb8.columns = columns;
+    HUF->rgb8.rows = rows;
     HUF->rgb8.channels = 3;
-    HUF->rgb8.row_stride = ID->columns * 3;
+    HUF->rgb8.row_stride = columns * 3;
     HUF->rgb8.data = HUF->rgb8.buf =
       (uint8_t *)malloc(sizeof(uint8_t)*size);
     break;
@@ -1393,9 +3627,10 @@ static void x3f_load_huffman(x3f_info_t *I,
   }
 
   if (row_stride == 0)
-    return x3f_load_huffman_compressed(I, DE, bits, use_map_table);
+    return x3f_load_huffman_compressed(I, DE, bits, use_map_table, req);
   else
-    return x3f_load_huffman_not_compressed(I, DE, bits, use_map_table, row_stride);
+    return x3f_load_huffman_not_compressed(I, DE, bits, use_map_table, row_stride,
+                                           req);
 }
 
 static void x3f_load_pixmap(x3f_info_t *I, x3f_directory_entry_t *DE)
@@ -1410,10 +3645,38 @@ static void x3f_load_jpeg(x3f_info_t *I, x3f_directory_entry_t *DE)
   x3f_load_image_verbatim(I, DE);
 }
 
-static void x3f_load_image(x3f_info_t *I, x3f_directory_entry_t *DE)
+static int release_data = 0;
+
+/* extern */ void x3f_set_release_data(int flag)
+{
+  release_data = flag;
+}
+
+/* Once decoded, the compressed data is only needed for dumping it,
+   which reads it anew anyway, so it can be let go of */
+
+static void release_image_data(x3f_info_t *I, x3f_image_data_t *ID)
+{
+  int i;
+
+  if (!release_data || ID->data == NULL) return;
+
+  x3f_printf(DEBUG, "Release %u bytes of image data\n", ID->data_size);
+
+  advise_done(I, ID->data, ID->data_size);
+  FREE_DATA(I, ID->data);
+
+  if (ID->tru != NULL)
+    for (i=0; i<TRUE_PLANES; i++)
+      ID->tru->plane_address[i] = NULL;
+}
+
+static x3f_return_t x3f_load_image(x3f_info_t *I, x3f_directory_entry_t *DE,
+				   const load_request_t *req)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  x3f_return_t ret = X3F_OK;
 
   read_data_set_offset(I, DE, X3F_IMAGE_HEADER_SIZE);
 
@@ -1423,17 +3686,20 @@ static void x3f_load_image(x3f_info_t *I, x3f_directory_entry_t *DE)
   case X3F_IMAGE_RAW_QUATTRO:
   case X3F_IMAGE_RAW_SDQ:
   case X3F_IMAGE_RAW_SDQH:
-    x3f_load_true(I, DE);
+    x3f_load_true(I, DE, req);
+    release_image_data(I, ID);
     break;
   case X3F_IMAGE_RAW_HUFFMAN_X530:
   case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-    x3f_load_huffman(I, DE, 10, 1, ID->row_stride);
+    ret = x3f_load_huffman(I, DE, 10, 1, ID->row_stride, req);
+    release_image_data(I, ID);
     break;
   case X3F_IMAGE_THUMB_PLAIN:
     x3f_load_pixmap(I, DE);
     break;
   case X3F_IMAGE_THUMB_HUFFMAN:
-    x3f_load_huffman(I, DE, 8, 0, ID->row_stride);
+    ret = x3f_load_huffman(I, DE, 8, 0, ID->row_stride, req);
+    release_image_data(I, ID);
     break;
   case X3F_IMAGE_THUMB_JPEG:
     x3f_load_jpeg(I, DE);
@@ -1442,25 +3708,96 @@ static void x3f_load_image(x3f_info_t *I, x3f_directory_entry_t *DE)
     /* TODO: Shouldn't this be treated as a fatal error? */
     x3f_printf(ERR, "Unknown image type\n");
   }
+
+  return ret;
+}
+
+/* CAMF type 2 is XOR:ed with bytes derived from a linear congruential
+   generator. The generator runs through all its 244944 states before
+   repeating, so the bytes for the whole cycle are computed once and
+   shared by all files and threads. Decrypting is then XOR:ing the
+   data with the cycle, starting at the position of the first state. */
+
+#define CAMF_T2_PERIOD 244944
+
+static uint8_t *camf_t2_keystream = NULL; /* Byte for each position */
+static uint32_t *camf_t2_position = NULL; /* Position of each state */
+
+static uint32_t camf_t2_next_key(uint32_t key)
+{
+  return (key * 1597 + 51749) % CAMF_T2_PERIOD;
+}
+
+static uint8_t camf_t2_key_byte(uint32_t key)
+{
+  uint32_t tmp = (uint32_t)(key * ((int64_t)301593171) >> 24);
+
+  return (uint8_t)(((((key << 8) - tmp) >> 1) + tmp) >> 17);
+}
+
+static void camf_t2_keystream_init(void)
+{
+  x3f_parallel_lock();
+
+  if (camf_t2_keystream == NULL) {
+    uint32_t key = 0;
+    uint32_t p;
+
+    camf_t2_keystream = (uint8_t *)malloc(CAMF_T2_PERIOD);
+    camf_t2_position =
+      (uint32_t *)malloc(CAMF_T2_PERIOD*sizeof(uint32_t));
+
+    for (p=0; p<CAMF_T2_PERIOD; p++) {
+      key = camf_t2_next_key(key);
+      camf_t2_keystream[p] = camf_t2_key_byte(key);
+      camf_t2_position[key] = p;
+    }
+  }
+
+  x3f_parallel_unlock();
+}
+
+static void camf_t2_xor(uint8_t *dst, uint8_t *src, uint8_t *key,
+			uint32_t size)
+{
+  uint32_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    __m128i s = _mm_loadu_si128((__m128i *)(src + i));
+    __m128i k = _mm_loadu_si128((__m128i *)(key + i));
+
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(s, k));
+  }
+#endif
+
+  for (; i < size; i++)
+    dst[i] = src[i] ^ key[i];
 }
 
 static void x3f_load_camf_decode_type2(x3f_camf_t *CAMF)
 {
-  uint32_t key = CAMF->t2.crypt_key;
-  int i;
+  /* NOTE: the first step is on the key from the file, which may be
+     out of range, so it has to be done in 32 bits like all the
+     others */
+  uint32_t key = camf_t2_next_key(CAMF->t2.crypt_key);
+  uint32_t p, i, n;
+  uint8_t *src = (uint8_t *)CAMF->data;
+  uint8_t *dst;
+
+  camf_t2_keystream_init();
 
   CAMF->decoded_data_size = CAMF->data_size;
   CAMF->decoded_data = malloc(CAMF->decoded_data_size);
+  dst = (uint8_t *)CAMF->decoded_data;
 
-  for (i=0; i<CAMF->data_size; i++) {
-    uint8_t old, new;
-    uint32_t tmp;
+  p = camf_t2_position[key];
 
-    old = ((uint8_t *)CAMF->data)[i];
-    key = (key * 1597 + 51749) % 244944;
-    tmp = (uint32_t)(key * ((int64_t)301593171) >> 24);
-    new = (uint8_t)(old ^ (uint8_t)(((((key << 8) - tmp) >> 1) + tmp) >> 17));
-    ((uint8_t *)CAMF->decoded_data)[i] = new;
+  for (i=0; i<CAMF->data_size; i+=n, p=0) {
+    n = CAMF->data_size - i;
+    if (n > CAMF_T2_PERIOD - p) n = CAMF_T2_PERIOD - p;
+
+    camf_t2_xor(dst + i, src + i, camf_t2_keystream + p, n);
   }
 }
 
@@ -1478,11 +3815,19 @@ static void camf_decode_type4(x3f_camf_t *CAMF)
 
   uint8_t *dst;
   uint32_t dst_size = CAMF->t4.decoded_data_size;
-  uint8_t *dst_end;
 
-  bool_t odd_dst = 0;
+  /* The values are 12 bits, i.e. two of them are packed into three
+     bytes. Decode as many as are needed to fill the data first, so
+     that the packing is a straight loop. Values past the end of the
+     blocks are zero, as is the data they would have filled. */
+  uint32_t num_values = (2*dst_size + 2)/3;
+  uint32_t n = 0;
+  uint16_t *values = (uint16_t *)calloc(num_values, sizeof(uint16_t));
+  uint16_t *v;
+  uint32_t i;
 
   x3f_hufftree_t *tree = &CAMF->tree;
+  x3f_true_lut_t *lut = &CAMF->lut;
   bit_state_t BS;
 
   int32_t row_start_acc[2][2];
@@ -1490,106 +3835,99 @@ static void camf_decode_type4(x3f_camf_t *CAMF)
   uint32_t cols = CAMF->t4.block_size;
 
   CAMF->decoded_data_size = dst_size;
-
   CAMF->decoded_data = malloc(CAMF->decoded_data_size);
-  memset(CAMF->decoded_data, 0, CAMF->decoded_data_size);
 
   dst = (uint8_t *)CAMF->decoded_data;
-  dst_end = dst + dst_size;
 
-  set_bit_state(&BS, CAMF->decoding_start);
+  set_bit_state(&BS, CAMF->decoding_start,
+		(uint8_t *)CAMF->data + CAMF->data_size);
 
   row_start_acc[0][0] = seed;
   row_start_acc[0][1] = seed;
   row_start_acc[1][0] = seed;
   row_start_acc[1][1] = seed;
 
-  for (row = 0; row < rows; row++) {
+  /* We loop through all the columns and the rows. But the actual data
+     is smaller than that, so we break the loop when having enough
+     values. */
+  for (row = 0; row < rows && n < num_values; row++) {
     int col;
     bool_t odd_row = row&1;
     int32_t acc[2];
 
-    /* We loop through all the columns and the rows. But the actual
-       data is smaller than that, so we break the loop when reaching
-       the end. */
-    for (col = 0; col < cols; col++) {
+    for (col = 0; col < cols && n < num_values; col++) {
       bool_t odd_col = col&1;
-      int32_t diff = get_true_diff(&BS, tree);
+      int32_t diff = get_true_diff_lut(&BS, lut, tree);
       int32_t prev = col < 2 ?
 	row_start_acc[odd_row][odd_col] :
-	acc[odd_col];
-      int32_t value = prev + diff;
-
-      acc[odd_col] = value;
-      if (col < 2)
-	row_start_acc[odd_row][odd_col] = value;
-
-      switch(odd_dst) {
-      case 0:
-	*dst++  = (uint8_t)((value>>4)&0xff);
-
-	if (dst >= dst_end) {
-	  goto ready;
-	}
-
-	*dst    = (uint8_t)((value<<4)&0xf0);
-	break;
-      case 1:
-	*dst++ |= (uint8_t)((value>>8)&0x0f);
-
-	if (dst >= dst_end) {
-	  goto ready;
-	}
-
-	*dst++  = (uint8_t)((value<<0)&0xff);
-
-	if (dst >= dst_end) {
-	  goto ready;
-	}
+	acc[odd_col];
+      int32_t value = prev + diff;
 
-	break;
-      }
+      acc[odd_col] = value;
+      if (col < 2)
+	row_start_acc[odd_row][odd_col] = value;
 
-      odd_dst = !odd_dst;
+      values[n++] = (uint16_t)(value & 0xfff);
     } /* end col */
   } /* end row */
 
- ready:;
+  for (i = 0, v = values; i + 3 <= dst_size; i += 3, v += 2) {
+    dst[i+0] = (uint8_t)(v[0]>>4);
+    dst[i+1] = (uint8_t)((v[0]<<4) | (v[1]>>8));
+    dst[i+2] = (uint8_t)(v[1]);
+  }
+
+  if (i + 0 < dst_size) dst[i+0] = (uint8_t)(v[0]>>4);
+  if (i + 1 < dst_size) dst[i+1] = (uint8_t)((v[0]<<4) | (v[1]>>8));
+
+  free(values);
 }
 
-static void x3f_load_camf_decode_type4(x3f_camf_t *CAMF)
+/* The Huffman table is stored first in the data, as code size and
+   code pairs, ended by a zero code size */
+
+static void x3f_load_camf_true_tables(x3f_info_t *I, x3f_camf_t *CAMF)
 {
-  int i;
+  int i, size;
   uint8_t *p;
-  x3f_true_huffman_element_t *element = NULL;
+  x3f_true_huffman_element_t *element;
 
-  for (i=0, p = CAMF->data; *p != 0; i++) {
-    /* TODO: Is this too expensive ??*/
-    element =
-      (x3f_true_huffman_element_t *)realloc(element, (i+1)*sizeof(*element));
+  for (size=0, p = CAMF->data; *p != 0; size++, p += 2);
 
+  element = (x3f_true_huffman_element_t *)
+    arena_alloc(&I->arena, size*sizeof(*element));
+
+  for (i=0, p = CAMF->data; i < size; i++) {
     element[i].code_size = *p++;
     element[i].code = *p++;
   }
 
-  CAMF->table.size = i;
+  CAMF->table.size = size;
   CAMF->table.element = element;
 
-  /* TODO: where does the values 28 and 32 come from? */
-#define CAMF_T4_DATA_SIZE_OFFSET 28
-#define CAMF_T4_DATA_OFFSET 32
-  CAMF->decoding_size = *(uint32_t *)(CAMF->data + CAMF_T4_DATA_SIZE_OFFSET);
-  CAMF->decoding_start = (uint8_t *)CAMF->data + CAMF_T4_DATA_OFFSET;
-
   /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
   new_huffman_tree(&CAMF->tree, 8);
 
   populate_true_huffman_tree(&CAMF->tree, &CAMF->table);
 
 #ifdef DBG_PRNT
-  print_huffman_tree(CAMF->tree.nodes, 0, 0);
+  print_huffman_tree(&CAMF->tree, 0, 0, 0);
 #endif
 
+  new_true_lut(&CAMF->lut);
+  populate_true_lut(&CAMF->lut, &CAMF->tree, 0, 0, 0);
+}
+
+static void x3f_load_camf_decode_type4(x3f_info_t *I, x3f_camf_t *CAMF)
+{
+  x3f_load_camf_true_tables(I, CAMF);
+
+  /* TODO: where does the values 28 and 32 come from? */
+#define CAMF_T4_DATA_SIZE_OFFSET 28
+#define CAMF_T4_DATA_OFFSET 32
+  CAMF->decoding_size = *(uint32_t *)(CAMF->data + CAMF_T4_DATA_SIZE_OFFSET);
+  CAMF->decoding_start = (uint8_t *)CAMF->data + CAMF_T4_DATA_OFFSET;
+
   camf_decode_type4(CAMF);
 }
 
@@ -1600,6 +3938,7 @@ static void camf_decode_type5(x3f_camf_t *CAMF)
   uint8_t *dst;
 
   x3f_hufftree_t *tree = &CAMF->tree;
+  x3f_true_lut_t *lut = &CAMF->lut;
   bit_state_t BS;
 
   int32_t i;
@@ -1609,33 +3948,20 @@ static void camf_decode_type5(x3f_camf_t *CAMF)
 
   dst = (uint8_t *)CAMF->decoded_data;
 
-  set_bit_state(&BS, CAMF->decoding_start);
+  set_bit_state(&BS, CAMF->decoding_start,
+		(uint8_t *)CAMF->data + CAMF->data_size);
 
   for (i = 0; i < CAMF->decoded_data_size; i++) {
-    int32_t diff = get_true_diff(&BS, tree);
+    int32_t diff = get_true_diff_lut(&BS, lut, tree);
 
     acc = acc + diff;
     *dst++ = (uint8_t)(acc & 0xff);
   }
 }
 
-static void x3f_load_camf_decode_type5(x3f_camf_t *CAMF)
+static void x3f_load_camf_decode_type5(x3f_info_t *I, x3f_camf_t *CAMF)
 {
-  int i;
-  uint8_t *p;
-  x3f_true_huffman_element_t *element = NULL;
-
-  for (i=0, p = CAMF->data; *p != 0; i++) {
-    /* TODO: Is this too expensive ??*/
-    element =
-      (x3f_true_huffman_element_t *)realloc(element, (i+1)*sizeof(*element));
-
-    element[i].code_size = *p++;
-    element[i].code = *p++;
-  }
-
-  CAMF->table.size = i;
-  CAMF->table.element = element;
+  x3f_load_camf_true_tables(I, CAMF);
 
   /* TODO: where does the values 28 and 32 come from? */
 #define CAMF_T5_DATA_SIZE_OFFSET 28
@@ -1643,15 +3969,6 @@ static void x3f_load_camf_decode_type5(x3f_camf_t *CAMF)
   CAMF->decoding_size = *(uint32_t *)(CAMF->data + CAMF_T5_DATA_SIZE_OFFSET);
   CAMF->decoding_start = (uint8_t *)CAMF->data + CAMF_T5_DATA_OFFSET;
 
-  /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
-  new_huffman_tree(&CAMF->tree, 8);
-
-  populate_true_huffman_tree(&CAMF->tree, &CAMF->table);
-
-#ifdef DBG_PRNT
-  print_huffman_tree(CAMF->tree.nodes, 0, 0);
-#endif
-
   camf_decode_type5(CAMF);
 }
 
@@ -1661,7 +3978,8 @@ static void x3f_setup_camf_text_entry(camf_entry_t *entry)
   entry->text = entry->value_address + 4;
 }
 
-static void x3f_setup_camf_property_entry(camf_entry_t *entry)
+static void x3f_setup_camf_property_entry(x3f_arena_t *A,
+					  camf_entry_t *entry)
 {
   int i;
   uint8_t *e =
@@ -1672,8 +3990,8 @@ static void x3f_setup_camf_property_entry(camf_entry_t *entry)
     entry->property_num = *(uint32_t *)v;
   uint32_t off = *(uint32_t *)(v + 4);
 
-  entry->property_name = (char **)malloc(num*sizeof(uint8_t*));
-  entry->property_value = (uint8_t **)malloc(num*sizeof(uint8_t*));
+  entry->property_name = (char **)arena_alloc(A, num*sizeof(uint8_t*));
+  entry->property_value = (uint8_t **)arena_alloc(A, num*sizeof(uint8_t*));
 
   for (i=0; i<num; i++) {
     uint32_t name_off = off + *(uint32_t *)(v + 8 + 8*i);
@@ -1682,6 +4000,9 @@ static void x3f_setup_camf_property_entry(camf_entry_t *entry)
     entry->property_name[i] = (char *)(e + name_off);
     entry->property_value[i] = e + value_off;
   }
+
+  new_name_index(A, &entry->property_index, entry->property_name,
+		 sizeof(char *), 0, num);
 }
 
 static void set_matrix_element_info(uint32_t type,
@@ -1719,26 +4040,32 @@ static void set_matrix_element_info(uint32_t type,
   }
 }
 
-static void get_matrix_copy(camf_entry_t *entry)
+/* Returns NULL if the memory could not be allocated */
+
+static void *get_matrix_copy(camf_entry_t *entry)
 {
   uint32_t element_size = entry->matrix_element_size;
   uint32_t elements = entry->matrix_elements;
   int i, size = (entry->matrix_decoded_type==M_FLOAT ?
 		 sizeof(double) :
 		 sizeof(uint32_t)) * elements;
+  void *decoded = malloc(size);
 
-  entry->matrix_decoded = malloc(size);
+  if (decoded == NULL) {
+    x3f_printf(ERR, "Could not allocate CAMF matrix\n");
+    return NULL;
+  }
 
   switch (element_size) {
   case 4:
     switch (entry->matrix_decoded_type) {
     case M_INT:
     case M_UINT:
-      memcpy(entry->matrix_decoded, entry->matrix_data, size);
+      memcpy(decoded, entry->matrix_data, size);
       break;
     case M_FLOAT:
       for (i=0; i<elements; i++)
-	((double *)entry->matrix_decoded)[i] =
+	((double *)decoded)[i] =
 	  (double)((float *)entry->matrix_data)[i];
       break;
     default:
@@ -1750,12 +4077,12 @@ static void get_matrix_copy(camf_entry_t *entry)
     switch (entry->matrix_decoded_type) {
     case M_INT:
       for (i=0; i<elements; i++)
-	((int32_t *)entry->matrix_decoded)[i] =
+	((int32_t *)decoded)[i] =
 	  (int32_t)((int16_t *)entry->matrix_data)[i];
       break;
     case M_UINT:
       for (i=0; i<elements; i++)
-	((uint32_t *)entry->matrix_decoded)[i] =
+	((uint32_t *)decoded)[i] =
 	  (uint32_t)((uint16_t *)entry->matrix_data)[i];
       break;
     default:
@@ -1767,12 +4094,12 @@ static void get_matrix_copy(camf_entry_t *entry)
     switch (entry->matrix_decoded_type) {
     case M_INT:
       for (i=0; i<elements; i++)
-	((int32_t *)entry->matrix_decoded)[i] =
+	((int32_t *)decoded)[i] =
 	  (int32_t)((int8_t *)entry->matrix_data)[i];
       break;
     case M_UINT:
       for (i=0; i<elements; i++)
-	((uint32_t *)entry->matrix_decoded)[i] =
+	((uint32_t *)decoded)[i] =
 	  (uint32_t)((uint8_t *)entry->matrix_data)[i];
       break;
     default:
@@ -1784,9 +4111,33 @@ static void get_matrix_copy(camf_entry_t *entry)
     x3f_printf(ERR, "Unknown size %d\n", element_size);
     assert(0);
   }
+
+  return decoded;
+}
+
+/* Few of the matrices are ever used, so they are only copied on the
+   first access. Only that takes the lock. Returns NULL if the matrix
+   could not be copied. */
+
+/* extern */ void *x3f_get_camf_matrix_decoded(camf_entry_t *entry)
+{
+  void *decoded = x3f_parallel_published(&entry->matrix_decoded);
+
+  if (decoded != NULL) return decoded;
+
+  x3f_parallel_lock();
+  decoded = entry->matrix_decoded;
+  if (decoded == NULL) {
+    decoded = get_matrix_copy(entry);
+    x3f_parallel_publish(&entry->matrix_decoded, decoded);
+  }
+  x3f_parallel_unlock();
+
+  return decoded;
 }
 
-static void x3f_setup_camf_matrix_entry(camf_entry_t *entry)
+static void x3f_setup_camf_matrix_entry(x3f_arena_t *A,
+					camf_entry_t *entry)
 {
   int i;
   int totalsize = 1;
@@ -1803,7 +4154,7 @@ static void x3f_setup_camf_matrix_entry(camf_entry_t *entry)
     entry->matrix_data_off = *(uint32_t *)(v + 8);
   camf_dim_entry_t *dentry =
     entry->matrix_dim_entry =
-    (camf_dim_entry_t*)malloc(dim*sizeof(camf_dim_entry_t));
+    (camf_dim_entry_t*)arena_alloc(A, dim*sizeof(camf_dim_entry_t));
 
   for (i=0; i<dim; i++) {
     uint32_t size =
@@ -1833,19 +4184,30 @@ static void x3f_setup_camf_matrix_entry(camf_entry_t *entry)
 
   /* This estimate only works for matrices above a certain size */
   entry->matrix_estimated_element_size = entry->matrix_used_space / totalsize;
-
-  get_matrix_copy(entry);
 }
 
-static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
+static void x3f_setup_camf_entries(x3f_info_t *I, x3f_camf_t *CAMF)
 {
   uint8_t *p = (uint8_t *)CAMF->decoded_data;
   uint8_t *end = p + CAMF->decoded_data_size;
-  camf_entry_t *entry = NULL;
-  int i;
+  camf_entry_t *entry;
+  int i, num;
 
   x3f_printf(DEBUG, "SETUP CAMF ENTRIES\n");
 
+  /* Count the entries first, to allocate them all at once */
+  for (num=0; p < end; num++) {
+    uint32_t *p4 = (uint32_t *)p;
+
+    if (p4[0] != X3F_CMbP && p4[0] != X3F_CMbT && p4[0] != X3F_CMbM)
+      break;
+
+    p += p4[2];
+  }
+
+  entry = (camf_entry_t *)arena_alloc(&I->arena, num*sizeof(camf_entry_t));
+  p = (uint8_t *)CAMF->decoded_data;
+
   for (i=0; p < end; i++) {
     uint32_t *p4 = (uint32_t *)p;
 
@@ -1863,9 +4225,6 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
       goto stop;
     }
 
-    /* TODO: lots of realloc - may be inefficient */
-    entry = (camf_entry_t *)realloc(entry, (i+1)*sizeof(camf_entry_t));
-
     /* Pointer */
     entry[i].entry = p;
 
@@ -1887,6 +4246,8 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
     entry[i].property_num = 0;
     entry[i].property_name = NULL;
     entry[i].property_value = NULL;
+    entry[i].property_index.size = 0;
+    entry[i].property_index.slot = NULL;
     entry[i].matrix_type = 0;
     entry[i].matrix_dim = 0;
     entry[i].matrix_data_off = 0;
@@ -1897,13 +4258,13 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
 
     switch (entry[i].id) {
     case X3F_CMbP:
-      x3f_setup_camf_property_entry(&entry[i]);
+      x3f_setup_camf_property_entry(&I->arena, &entry[i]);
       break;
     case X3F_CMbT:
       x3f_setup_camf_text_entry(&entry[i]);
       break;
     case X3F_CMbM:
-      x3f_setup_camf_matrix_entry(&entry[i]);
+      x3f_setup_camf_matrix_entry(&I->arena, &entry[i]);
       break;
     }
 
@@ -1915,6 +4276,9 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
   CAMF->entry_table.size = i;
   CAMF->entry_table.element = entry;
 
+  new_name_index(&I->arena, &CAMF->entry_index, entry, sizeof(camf_entry_t),
+		 offsetof(camf_entry_t, name_address), i);
+
   x3f_printf(DEBUG, "SETUP CAMF ENTRIES (READY) Found %d entries\n", i);
 }
 
@@ -1934,10 +4298,10 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
     x3f_load_camf_decode_type2(CAMF);
     break;
   case 4:			/* TRUE ... Merrill */
-    x3f_load_camf_decode_type4(CAMF);
+    x3f_load_camf_decode_type4(I, CAMF);
     break;
   case 5:			/* Quattro ... */
-    x3f_load_camf_decode_type5(CAMF);
+    x3f_load_camf_decode_type5(I, CAMF);
     break;
   default:
     /* TODO: Shouldn't this be treated as a fatal error? */
@@ -1945,13 +4309,14 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
   }
 
   if (CAMF->decoded_data != NULL)
-    x3f_setup_camf_entries(CAMF);
+    x3f_setup_camf_entries(I, CAMF);
   else
     /* TODO: Shouldn't this be treated as a fatal error? */
     x3f_printf(ERR, "No decoded CAMF data\n");
 }
 
-/* extern */ x3f_return_t x3f_load_data(x3f_t *x3f, x3f_directory_entry_t *DE)
+static x3f_return_t load_data(x3f_t *x3f, x3f_directory_entry_t *DE,
+			      const load_request_t *req)
 {
   x3f_info_t *I = &x3f->info;
 
@@ -1963,8 +4328,7 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
     x3f_load_property_list(I, DE);
     break;
   case X3F_SECi:
-    x3f_load_image(I, DE);
-    break;
+    return x3f_load_image(I, DE, req);
   case X3F_SECc:
     x3f_load_camf(I, DE);
     break;
@@ -1976,6 +4340,126 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
   return X3F_OK;
 }
 
+/* extern */ x3f_return_t x3f_load_data(x3f_t *x3f, x3f_directory_entry_t *DE)
+{
+  load_request_t req = {NULL, 1, 0, NULL, NULL};
+
+  return load_data(x3f, DE, &req);
+}
+
+static int valid_roi(x3f_image_data_t *ID, uint32_t *rect)
+{
+  return
+    rect[0] <= rect[2] && rect[1] <= rect[3] &&
+    rect[2] < ID->columns && rect[3] < ID->rows;
+}
+
+/* Load only the part of an image within rect, i.e. left, top, right,
+   bottom (all inclusive) in the columns and rows of the image. The
+   resulting area is only as big as rect, and no rows below rect are
+   decoded. For compressed Huffman images with automatic legacy
+   offset, i.e. auto_legacy_offset, all rows are still decoded, as the
+   offset depends on the minimum of the whole image. */
+
+/* extern */ x3f_return_t x3f_load_data_roi(x3f_t *x3f, x3f_directory_entry_t *DE,
+					    uint32_t *rect)
+{
+  load_request_t req = {rect, 1, 0, NULL, NULL};
+  x3f_image_data_t *ID;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  if (!valid_roi(ID, rect))
+    return X3F_ARGUMENT_ERROR;
+
+  return load_data(x3f, DE, &req);
+}
+
+/* Load an image binned, i.e. with each bin x bin pixels replaced by
+   their mean. The binning is done while decoding, so the full size
+   image is never stored. Bins at the right and bottom edges may be
+   smaller. Only TRUE RAW and compressed Huffman images can be
+   binned. */
+
+/* extern */ x3f_return_t x3f_load_data_binned(x3f_t *x3f,
+					    x3f_directory_entry_t *DE,
+					    uint32_t bin)
+{
+  load_request_t req = {NULL, bin, 0, NULL, NULL};
+  x3f_image_data_t *ID;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi || bin == 0)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_TRUE:
+  case X3F_IMAGE_RAW_MERRILL:
+  case X3F_IMAGE_RAW_QUATTRO:
+  case X3F_IMAGE_RAW_SDQ:
+  case X3F_IMAGE_RAW_SDQH:
+    break;
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    if (ID->row_stride == 0)
+      break;
+    /* Fall through */
+  default:
+    x3f_printf(ERR, "Image type can not be binned\n");
+    return X3F_ARGUMENT_ERROR;
+  }
+
+  return load_data(x3f, DE, &req);
+}
+
+/* Load a TRUE RAW image with all planes decoded together, band_rows
+   rows of the areas at a time. After each band, callback is called
+   with ctx and the rows of the band, which are then complete in all
+   areas. The next stage can thus work on them while they are still
+   in the cache. If rect is not NULL, only the part of the image
+   within it is loaded, as for x3f_load_data_roi. If bin is above 1,
+   the image is binned, as for x3f_load_data_binned. */
+
+/* extern */ x3f_return_t x3f_load_data_banded(x3f_t *x3f,
+					    x3f_directory_entry_t *DE,
+					    uint32_t *rect,
+					    uint32_t bin,
+					    uint32_t band_rows,
+					    x3f_band_callback_t callback,
+					    void *ctx)
+{
+  load_request_t req = {rect, bin > 1 ? bin : 1, band_rows, callback, ctx};
+  x3f_image_data_t *ID;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi ||
+      band_rows == 0 || callback == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_TRUE:
+  case X3F_IMAGE_RAW_MERRILL:
+  case X3F_IMAGE_RAW_QUATTRO:
+  case X3F_IMAGE_RAW_SDQ:
+  case X3F_IMAGE_RAW_SDQH:
+    break;
+  default:
+    x3f_printf(ERR, "Image type can not be decoded in bands\n");
+    return X3F_ARGUMENT_ERROR;
+  }
+
+  if (rect != NULL && !valid_roi(ID, rect))
+    return X3F_ARGUMENT_ERROR;
+
+  return load_data(x3f, DE, &req);
+}
+
 /* extern */ x3f_return_t x3f_load_image_block(x3f_t *x3f, x3f_directory_entry_t *DE)
 {
   x3f_info_t *I = &x3f->info;
@@ -1998,6 +4482,352 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
   return X3F_OK;
 }
 
+/* --------------------------------------------------------------------- */
+/* Accounting for the memory held                                        */
+/* --------------------------------------------------------------------- */
+
+static void memory_data(x3f_info_t *I, void *data, uint32_t size,
+			x3f_memory_t *mem)
+{
+  if (data == NULL) return;
+
+  /* As for FREE_DATA */
+  if (in_input(I, data))
+    mem->mapped += size;
+  else
+    mem->data += size;
+}
+
+static size_t memory_area16(x3f_area16_t *A, int planes)
+{
+  if (A->buf == NULL) return 0;
+
+  return (size_t)planes*A->rows*A->row_stride*sizeof(uint16_t);
+}
+
+static size_t memory_area8(x3f_area8_t *A)
+{
+  if (A->buf == NULL) return 0;
+
+  return (size_t)A->rows*A->row_stride*sizeof(uint8_t);
+}
+
+static size_t memory_name_index(x3f_name_index_t *index)
+{
+  return (size_t)index->size*sizeof(uint32_t);
+}
+
+static size_t memory_tree(x3f_hufftree_t *tree)
+{
+  return tree->nodes != NULL ?
+    (size_t)tree->total_node_count*sizeof(x3f_huffnode_t) : 0;
+}
+
+static void memory_image(x3f_info_t *I, x3f_image_data_t *ID,
+			 x3f_memory_t *mem)
+{
+  memory_data(I, ID->data, ID->data_size, mem);
+
+  if (ID->tru != NULL) {
+    x3f_true_t *TRU = ID->tru;
+
+    mem->tables +=
+      TRU->table.size*sizeof(x3f_true_huffman_element_t) +
+      TRU->plane_size.size*sizeof(uint32_t);
+    /* The tables shared with other files are not counted */
+    if (TRU->cached == NULL)
+      mem->tables += memory_tree(&TRU->tree) +
+	(TRU->lut.entry != NULL ?
+	 (1<<X3F_TRUE_LUT_BITS)*sizeof(x3f_true_lut_entry_t) : 0);
+    mem->decoded +=
+      memory_area16(&TRU->x3rgb16, 1) +
+      memory_area16(&TRU->plane16[0], TRUE_PLANES);
+  }
+
+  if (ID->quattro != NULL)
+    mem->decoded += memory_area16(&ID->quattro->top16, 1);
+
+  if (ID->huffman != NULL) {
+    x3f_huffman_t *HUF = ID->huffman;
+
+    mem->tables +=
+      HUF->mapping.size*sizeof(uint16_t) +
+      HUF->table.size*sizeof(uint32_t) +
+      HUF->row_offsets.size*sizeof(uint32_t);
+    if (HUF->cached == NULL)
+      mem->tables += memory_tree(&HUF->tree) +
+	HUF->lut.size*sizeof(x3f_huff_lut_entry_t);
+    mem->decoded +=
+      memory_area8(&HUF->rgb8) +
+      memory_area16(&HUF->x3rgb16, 1) +
+      memory_area16(&HUF->plane16[0], 3);
+  }
+
+  if (ID->true_index != NULL) {
+    int color;
+
+    mem->tables += sizeof(x3f_true_index_t);
+    for (color = 0; color < TRUE_PLANES; color++)
+      mem->tables +=
+	ID->true_index->plane[color].size*sizeof(x3f_true_restart_t);
+  }
+}
+
+static void memory_camf(x3f_info_t *I, x3f_camf_t *CAMF, x3f_memory_t *mem)
+{
+  uint32_t i;
+
+  memory_data(I, CAMF->data, CAMF->data_size, mem);
+
+  if (CAMF->decoded_data != NULL)
+    mem->decoded += CAMF->decoded_data_size;
+
+  mem->tables +=
+    CAMF->table.size*sizeof(x3f_true_huffman_element_t) +
+    memory_tree(&CAMF->tree) +
+    (CAMF->lut.entry != NULL ?
+     (1<<X3F_TRUE_LUT_BITS)*sizeof(x3f_true_lut_entry_t) : 0) +
+    CAMF->entry_table.size*sizeof(camf_entry_t) +
+    memory_name_index(&CAMF->entry_index);
+
+  for (i=0; i<CAMF->entry_table.size; i++) {
+    camf_entry_t *entry = &CAMF->entry_table.element[i];
+
+    if (entry->property_name != NULL)
+      mem->tables += 2*entry->property_num*sizeof(uint8_t *) +
+	memory_name_index(&entry->property_index);
+    if (entry->matrix_dim_entry != NULL)
+      mem->tables += entry->matrix_dim*sizeof(camf_dim_entry_t);
+    if (entry->matrix_decoded != NULL)
+      mem->tables += entry->matrix_elements *
+	(entry->matrix_decoded_type == M_FLOAT ?
+	 sizeof(double) : sizeof(uint32_t));
+  }
+}
+
+static void memory_property_list(x3f_info_t *I, x3f_property_list_t *PL,
+				 x3f_memory_t *mem)
+{
+  uint32_t i;
+
+  memory_data(I, PL->data, PL->data_size, mem);
+
+  mem->tables +=
+    PL->property_table.size*sizeof(x3f_property_t) +
+    memory_name_index(&PL->property_index);
+
+  for (i=0; i<PL->property_table.size; i++) {
+    x3f_property_t *P = &PL->property_table.element[i];
+
+    if (P->name_utf8 != NULL) mem->tables += strlen(P->name_utf8) + 1;
+    if (P->value_utf8 != NULL) mem->tables += strlen(P->value_utf8) + 1;
+  }
+}
+
+/* Get the number of bytes of memory held for the section in DE, or
+   for the whole file, including the directory and the unused part of
+   the arena, if DE is NULL. Trees and lookup tables in the cache,
+   shared with other files, are not counted. NOTE: the data in a
+   mapped file is only counted if it is still referenced, regardless
+   of whether it is in memory or not. */
+
+/* extern */ x3f_return_t x3f_get_memory(x3f_t *x3f,
+					 x3f_directory_entry_t *DE,
+					 x3f_memory_t *mem)
+{
+  x3f_info_t *I = &x3f->info;
+  x3f_directory_section_t *DS = &x3f->directory_section;
+  uint32_t d;
+
+  memset(mem, 0, sizeof(x3f_memory_t));
+
+  for (d=0; d<DS->num_directory_entries; d++) {
+    x3f_directory_entry_t *DEd = &DS->directory_entry[d];
+    x3f_directory_entry_header_t *DEH = &DEd->header;
+
+    if (DE != NULL && DE != DEd) continue;
+
+    switch (DEH->identifier) {
+    case X3F_SECp:
+      memory_property_list(I, &DEH->data_subsection.property_list, mem);
+      break;
+    case X3F_SECi:
+      memory_image(I, &DEH->data_subsection.image_data, mem);
+      break;
+    case X3F_SECc:
+      memory_camf(I, &DEH->data_subsection.camf, mem);
+      break;
+    }
+  }
+
+  if (DE == NULL)
+    mem->tables += sizeof(x3f_t) +
+      DS->num_directory_entries*sizeof(x3f_directory_entry_t) +
+      I->arena.size - I->arena.used;
+  else if (DE < DS->directory_entry ||
+	   DE >= DS->directory_entry + DS->num_directory_entries)
+    return X3F_ARGUMENT_ERROR;
+
+  return X3F_OK;
+}
+
+/* --------------------------------------------------------------------- */
+/* Saving and loading the TRUE restart index                             */
+/* --------------------------------------------------------------------- */
+
+/* The index is saved in a small file, little endian, as:
+     "X3TI", version, unique identifier of the X3F file, offset and
+     size of the RAW directory entry, rows between restart points and
+     then for each plane the number of restart points followed by the
+     restart points, as 64 bit offset and four 32 bit predictors. */
+
+#define X3F_TRUE_INDEX_MAGIC "X3TI"
+#define X3F_TRUE_INDEX_VERSION 1
+
+static void put4(FILE *f, uint32_t v)
+{
+  putc(v>>0, f);
+  putc(v>>8, f);
+  putc(v>>16, f);
+  putc(v>>24, f);
+}
+
+static uint32_t get4(FILE *f, int *eof)
+{
+  uint8_t b[4];
+
+  if (fread(b, 1, 4, f) != 4) {
+    *eof = 1;
+    return 0;
+  }
+
+  return b[0] | (b[1]<<8) | (b[2]<<16) | ((uint32_t)b[3]<<24);
+}
+
+/* extern */ x3f_return_t x3f_save_true_index(x3f_t *x3f, char *outfilename)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_true_index_t *index;
+  FILE *f_out;
+  int color;
+  uint32_t i;
+
+  if (DE == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  index = DE->header.data_subsection.image_data.true_index;
+  if (index == NULL)
+    return X3F_INTERNAL_ERROR;
+
+  if ((f_out = fopen(outfilename, "wb")) == NULL)
+    return X3F_OUTFILE_ERROR;
+
+  fwrite(X3F_TRUE_INDEX_MAGIC, 1, 4, f_out);
+  put4(f_out, X3F_TRUE_INDEX_VERSION);
+  fwrite(x3f->header.unique_identifier, 1, SIZE_UNIQUE_IDENTIFIER, f_out);
+  put4(f_out, DE->input.offset);
+  put4(f_out, DE->input.size);
+  put4(f_out, index->rows);
+
+  for (color = 0; color < TRUE_PLANES; color++) {
+    put4(f_out, index->plane[color].size);
+    for (i = 0; i < index->plane[color].size; i++) {
+      x3f_true_restart_t *R = &index->plane[color].element[i];
+
+      put4(f_out, (uint32_t)R->bit_offset);
+      put4(f_out, (uint32_t)(R->bit_offset>>32));
+      put4(f_out, R->row_start_acc[0][0]);
+      put4(f_out, R->row_start_acc[0][1]);
+      put4(f_out, R->row_start_acc[1][0]);
+      put4(f_out, R->row_start_acc[1][1]);
+    }
+  }
+
+  if (fclose(f_out) != 0)
+    return X3F_OUTFILE_ERROR;
+
+  return X3F_OK;
+}
+
+/* Shall be called before the RAW data is loaded. The index is checked
+   against the X3F file, and again against the image when decoding. */
+
+/* extern */ x3f_return_t x3f_load_true_index(x3f_t *x3f, char *infilename)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_image_data_t *ID;
+  x3f_true_index_t *index;
+  uint8_t magic[4];
+  uint8_t unique_identifier[SIZE_UNIQUE_IDENTIFIER];
+  FILE *f_in;
+  int eof = 0;
+  int color;
+  uint32_t i;
+
+  if (DE == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  if ((f_in = fopen(infilename, "rb")) == NULL)
+    return X3F_INFILE_ERROR;
+
+  if (fread(magic, 1, 4, f_in) != 4 ||
+      memcmp(magic, X3F_TRUE_INDEX_MAGIC, 4) != 0 ||
+      get4(f_in, &eof) != X3F_TRUE_INDEX_VERSION ||
+      fread(unique_identifier, 1, SIZE_UNIQUE_IDENTIFIER, f_in) !=
+      SIZE_UNIQUE_IDENTIFIER ||
+      memcmp(unique_identifier, x3f->header.unique_identifier,
+	     SIZE_UNIQUE_IDENTIFIER) != 0 ||
+      get4(f_in, &eof) != DE->input.offset ||
+      get4(f_in, &eof) != DE->input.size) {
+    x3f_printf(DEBUG, "TRUE restart index %s does not match\n", infilename);
+    fclose(f_in);
+    return X3F_INFILE_ERROR;
+  }
+
+  index = (x3f_true_index_t *)calloc(1, sizeof(x3f_true_index_t));
+  index->rows = get4(f_in, &eof);
+
+  for (color = 0; color < TRUE_PLANES && !eof; color++) {
+    uint32_t size = get4(f_in, &eof);
+
+    /* Guard against garbage, there can't be more points than rows */
+    if (eof || index->rows == 0 || size > ID->rows) {
+      eof = 1;
+      break;
+    }
+
+    index->plane[color].size = size;
+    index->plane[color].element =
+      (x3f_true_restart_t *)malloc(size * sizeof(x3f_true_restart_t));
+
+    for (i = 0; i < size; i++) {
+      x3f_true_restart_t *R = &index->plane[color].element[i];
+
+      R->bit_offset = get4(f_in, &eof);
+      R->bit_offset |= (uint64_t)get4(f_in, &eof) << 32;
+      R->row_start_acc[0][0] = get4(f_in, &eof);
+      R->row_start_acc[0][1] = get4(f_in, &eof);
+      R->row_start_acc[1][0] = get4(f_in, &eof);
+      R->row_start_acc[1][1] = get4(f_in, &eof);
+    }
+  }
+
+  fclose(f_in);
+
+  if (eof) {
+    x3f_printf(ERR, "Faulty TRUE restart index %s\n", infilename);
+    cleanup_true_index(&index);
+    return X3F_INFILE_ERROR;
+  }
+
+  cleanup_true_index(&ID->true_index);
+  ID->true_index = index;
+
+  return X3F_OK;
+}
+
 /* extern */ char *x3f_err(x3f_return_t err)
 {
   switch (err) {
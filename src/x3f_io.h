@@ -109,6 +109,13 @@ typedef enum x3f_extended_types_e {
   X3F_EXT_TYPE_FILL_LIGHT_ADJUST=10
 } x3f_extended_types_t;
 
+/* Hash table from names to their index in a table, with open
+   addressing */
+typedef struct x3f_name_index_s {
+  uint32_t size;		/* Number of slots, a power of two */
+  uint32_t *slot;		/* Index in the table + 1, 0 if empty */
+} x3f_name_index_t;
+
 typedef struct x3f_property_s {
   /* Read from file */
   uint32_t name_offset;
@@ -134,6 +141,7 @@ typedef struct x3f_property_list_s {
   uint32_t total_length;
 
   x3f_property_table_t property_table;
+  x3f_name_index_t property_index;
 
   void *data;
 
@@ -176,18 +184,48 @@ typedef struct
   uint32_t row_stride;
 } x3f_area16_t;
 
+/* In the planar layout, each color is an area of its own with one
+   channel, and each row starts at an X3F_PLANE_ALIGN byte boundary */
+#define X3F_PLANE_ALIGN 64
+
 #define UNDEFINED_LEAF 0xffffffff
 
+/* The nodes of a tree are kept in one array, breadth first, with the
+   root at index 0. As the root is nobody's child, a branch index of
+   0 means that there is no such branch. */
 typedef struct x3f_huffnode_s {
-  struct x3f_huffnode_s *branch[2];
+  uint16_t branch[2];		/* Index of child nodes, 0 if none */
   uint32_t leaf;
 } x3f_huffnode_t;
 
 typedef struct x3f_hufftree_s {
   uint32_t free_node_index; /* Free node index in huffman tree array */
+  uint32_t total_node_count; /* Size of huffman tree array */
   x3f_huffnode_t *nodes;    /* Coding tree */
 } x3f_hufftree_t;
 
+/* Multi level lookup table for the legacy Huffman codes, which can
+   be up to 27 bits long. The first table is indexed by the next
+   X3F_HUFF_LUT_BITS bits. An entry with sub_bits non zero consumes
+   length bits and continues in the sub table starting at entry
+   number value, indexed by the next sub_bits bits. Otherwise the
+   entry consumes length bits and yields value, or, if invalid is
+   set, flags a coding error. */
+#define X3F_HUFF_LUT_BITS 11
+#define X3F_HUFF_LUT_SUB_BITS 8
+
+typedef struct x3f_huff_lut_entry_s {
+  uint32_t value;
+  uint8_t length;
+  uint8_t sub_bits;
+  uint8_t invalid;
+} x3f_huff_lut_entry_t;
+
+typedef struct x3f_huff_lut_s {
+  uint32_t size;		/* Total number of entries */
+  x3f_huff_lut_entry_t *entry;
+} x3f_huff_lut_t;
+
 typedef struct x3f_true_huffman_element_s {
   uint8_t code_size;
   uint8_t code;
@@ -198,6 +236,24 @@ typedef struct x3f_true_huffman_s {
   x3f_true_huffman_element_t *element;
 } x3f_true_huffman_t;
 
+/* Lookup table for TRUE coded diffs, indexed by the next
+   X3F_TRUE_LUT_BITS bits in the stream. If total_length is non zero,
+   both the code and the diff payload fit in the index and diff is
+   the decoded value. Otherwise, if code_length is non zero, only the
+   code fits and diff holds the number of payload bits. Entries with
+   both zero fall back to walking the tree. */
+#define X3F_TRUE_LUT_BITS 12
+
+typedef struct x3f_true_lut_entry_s {
+  int16_t diff;
+  uint8_t code_length;
+  uint8_t total_length;
+} x3f_true_lut_entry_t;
+
+typedef struct x3f_true_lut_s {
+  x3f_true_lut_entry_t *entry;	/* 1<<X3F_TRUE_LUT_BITS entries */
+} x3f_true_lut_t;
+
 /* 0=bottom, 1=middle, 2=top */
 #define TRUE_PLANES 3
 
@@ -211,9 +267,35 @@ typedef struct x3f_true_s {
   x3f_table32_t plane_size;	/* Size of the 3 planes */
   uint8_t *plane_address[TRUE_PLANES]; /* computed offset to the planes */
   x3f_hufftree_t tree;		/* Coding tree */
+  x3f_true_lut_t lut;		/* Lookup table built from tree */
+  struct x3f_cached_tables_s *cached; /* Owner of tree and lut if
+					 shared with other files */
   x3f_area16_t x3rgb16;		/* 3x16 bit X3-RGB data */
+  x3f_area16_t plane16[TRUE_PLANES]; /* Planar 16 bit X3-RGB data */
 } x3f_true_t;
 
+/* Restart points in the TRUE planes, every TRUE_RESTART_ROWS rows.
+   With those, the rows of a plane can be decoded in parallel bands. */
+
+#define TRUE_RESTART_ROWS 64	/* Must be even */
+
+typedef struct x3f_true_restart_s {
+  uint64_t bit_offset;		/* From the start of the plane */
+  int32_t row_start_acc[2][2];	/* Predictor state at start of row */
+} x3f_true_restart_t;
+
+typedef struct x3f_true_index_s {
+  uint32_t rows;		/* Number of rows between restart points */
+  struct {
+    uint32_t size;
+    x3f_true_restart_t *element;
+  } plane[TRUE_PLANES];
+} x3f_true_index_t;
+
+/* Called with the first row and number of rows of each band of the
+   RAW areas, as soon as they are decoded */
+typedef void (*x3f_band_callback_t)(void *ctx, uint32_t row, uint32_t rows);
+
 typedef struct x3f_quattro_s {
   struct {
     uint16_t columns;
@@ -229,9 +311,13 @@ typedef struct x3f_huffman_s {
   x3f_table16_t mapping;   /* Value Mapping = X3F lossy compression */
   x3f_table32_t table;          /* Coding Table */
   x3f_hufftree_t tree;		/* Coding tree */
+  x3f_huff_lut_t lut;		/* Lookup tables built from tree */
+  struct x3f_cached_tables_s *cached; /* Owner of tree and lut if
+					 shared with other files */
   x3f_table32_t row_offsets;    /* Row offsets */
   x3f_area8_t rgb8;		/* 3x8 bit RGB data */
   x3f_area16_t x3rgb16;		/* 3x16 bit X3-RGB data */
+  x3f_area16_t plane16[3];	/* Planar 16 bit X3-RGB data */
 } x3f_huffman_t;
 
 typedef struct x3f_image_data_s {
@@ -257,6 +343,10 @@ typedef struct x3f_image_data_s {
   x3f_huffman_t *huffman;       /* Huffman help data */
   x3f_true_t *tru;		/* TRUE help data */
   x3f_quattro_t *quattro;	/* Quattro help data */
+  x3f_true_index_t *true_index;	/* TRUE restart points */
+
+  /* The RAW data is in plane16, not in x3rgb16 */
+  bool_t planar;
 
   void *data;                   /* Take from file if NULL. Otherwise,
                                    this is the actual data bytes in
@@ -298,6 +388,7 @@ typedef struct camf_entry_s {
   uint32_t property_num;
   char **property_name;
   uint8_t **property_value;
+  x3f_name_index_t property_index;
 
   uint32_t matrix_dim;
   camf_dim_entry_t *matrix_dim_entry;
@@ -308,7 +399,7 @@ typedef struct camf_entry_s {
   void *matrix_data;
   uint32_t matrix_element_size;
 
-  /* Pointer and type of copied data */
+  /* Pointer and type of copied data, copied on first access */
   matrix_type_t matrix_decoded_type;
   void *matrix_decoded;
 
@@ -367,9 +458,10 @@ typedef struct x3f_camf_s {
   void *data;
   uint32_t data_size;
 
-  /* Help data for type 4 Huffman compression */
+  /* Help data for type 4 and 5 Huffman compression */
   x3f_true_huffman_t table;
   x3f_hufftree_t tree;
+  x3f_true_lut_t lut;
   uint8_t *decoding_start;
   uint32_t decoding_size;
 
@@ -379,6 +471,7 @@ typedef struct x3f_camf_s {
 
   /* Pointers into the decrypted data */
   camf_entry_table_t entry_table;
+  x3f_name_index_t entry_index;
 } x3f_camf_t;
 
 typedef struct x3f_directory_entry_header_s {
@@ -429,17 +522,44 @@ typedef struct x3f_header_s {
   float extended_data[NUM_EXT_DATA]; /* 32 bits, but do type differ? */
 } x3f_header_t;
 
+/* Memory for the tables of a file, freed all at once on delete */
+typedef struct x3f_arena_s {
+  struct x3f_arena_block_s *block; /* Block allocated from, then the rest */
+  size_t size;			/* Bytes in all blocks */
+  size_t used;			/* Bytes handed out */
+} x3f_arena_t;
+
 typedef struct x3f_info_s {
   char *error;
   struct {
     FILE *file;                 /* Use if more data is needed */
   } input, output;
+  /* The whole input, if held in memory. The data blocks then point
+     into it and are not freed. */
+  struct {
+    uint8_t *data;
+    size_t size;
+    size_t pos;                 /* Read position, if there is no file */
+    bool_t mapped;              /* Mapped file, unmapped on delete */
+    bool_t map_tried;           /* Mapping is tried before the first block */
+    void (*free_data)(void *data); /* If not NULL, called on delete */
+  } memory;
+  x3f_arena_t arena;
 } x3f_info_t;
 
 typedef struct x3f_s {
   x3f_info_t info;
   x3f_header_t header;
   x3f_directory_section_t directory_section;
+  /* The first entry of each kind, found when the file is opened */
+  struct {
+    x3f_directory_entry_t *raw;
+    x3f_directory_entry_t *thumb_plain;
+    x3f_directory_entry_t *thumb_huffman;
+    x3f_directory_entry_t *thumb_jpeg;
+    x3f_directory_entry_t *camf;
+    x3f_directory_entry_t *prop;
+  } entry;
 } x3f_t;
 
 typedef enum x3f_return_e {
@@ -450,11 +570,38 @@ typedef enum x3f_return_e {
   X3F_INTERNAL_ERROR=4
 } x3f_return_t;
 
+/* Bytes of memory held for a section, see x3f_get_memory() */
+typedef struct x3f_memory_s {
+  size_t data;			/* Data read from the file */
+  size_t mapped;		/* Data in the mapped file, or in the
+				   memory given to x3f_new_from_memory() */
+  size_t decoded;		/* Decoded image areas and CAMF data */
+  size_t tables;		/* Tables, trees, lookup tables, indexes
+				   and CAMF entries */
+} x3f_memory_t;
+
 extern int legacy_offset;
 extern bool_t auto_legacy_offset;
 
+extern void x3f_set_use_mmap(int flag);
+
+extern void x3f_set_use_bulk_parse(int flag);
+
+extern void x3f_set_release_data(int flag);
+
+extern void x3f_set_use_table_cache(int flag);
+
+extern void x3f_clear_table_cache(void);
+
+extern void x3f_set_use_planar(int flag);
+
 extern x3f_t *x3f_new_from_file(FILE *infile);
 
+/* The x3f takes over data, to be freed with free_data, only if it is
+   returned. If NULL is returned, the caller still owns data. */
+extern x3f_t *x3f_new_from_memory(void *data, size_t size,
+				  void (*free_data)(void *data));
+
 extern x3f_return_t x3f_delete(x3f_t *x3f);
 
 extern x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f);
@@ -469,10 +616,49 @@ extern x3f_directory_entry_t *x3f_get_camf(x3f_t *x3f);
 
 extern x3f_directory_entry_t *x3f_get_prop(x3f_t *x3f);
 
+extern x3f_directory_entry_t *x3f_get_next(x3f_t *x3f,
+					   x3f_directory_entry_t *DE,
+					   uint32_t identifier);
+
+extern camf_entry_t *x3f_find_camf_entry(x3f_camf_t *CAMF, char *name);
+
+extern int32_t x3f_find_camf_property(camf_entry_t *entry, char *name);
+
+extern x3f_property_t *x3f_find_property(x3f_property_list_t *PL,
+					 char *name);
+
+extern void *x3f_get_camf_matrix_decoded(camf_entry_t *entry);
+
 extern x3f_return_t x3f_load_data(x3f_t *x3f, x3f_directory_entry_t *DE);
 
 extern x3f_return_t x3f_load_image_block(x3f_t *x3f, x3f_directory_entry_t *DE);
 
+extern x3f_return_t x3f_get_memory(x3f_t *x3f, x3f_directory_entry_t *DE,
+				   x3f_memory_t *mem);
+
+/* Only rect, i.e. left, top, right, bottom (inclusive), is stored,
+   and no rows below it are decoded. Compressed Huffman images are
+   still decoded in full with auto_legacy_offset set, to find the
+   offset. */
+extern x3f_return_t x3f_load_data_roi(x3f_t *x3f, x3f_directory_entry_t *DE,
+				      uint32_t *rect);
+
+extern x3f_return_t x3f_load_data_binned(x3f_t *x3f,
+					 x3f_directory_entry_t *DE,
+					 uint32_t bin);
+
+extern x3f_return_t x3f_load_data_banded(x3f_t *x3f,
+					 x3f_directory_entry_t *DE,
+					 uint32_t *rect,
+					 uint32_t bin,
+					 uint32_t band_rows,
+					 x3f_band_callback_t callback,
+					 void *ctx);
+
+extern x3f_return_t x3f_load_true_index(x3f_t *x3f, char *infilename);
+
+extern x3f_return_t x3f_save_true_index(x3f_t *x3f, char *outfilename);
+
 extern char *x3f_err(x3f_return_t err);
 
 #ifdef __cplusplus
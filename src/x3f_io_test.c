@@ -18,11 +18,205 @@
 static void usage(char *progname)
 {
   fprintf(stderr,
-          "usage: %s [-unpack] [-noprint] <X3F-file>\n",
+          "usage: %s [-unpack] [-noprint] [-stream] [-memory] [-bands <N>]"
+          " [-roi <L> <T> <R> <B>] [-bin <N>] [-planar] [-release]"
+          " [-load-index <file>] [-save-index <file>] <X3F-file>\n"
+          "   -stream      Parse the header and directory value by value\n"
+          "   -memory      Read all of the file into memory before decoding\n"
+          "   -bands       Decode TRUE RAW data in bands of <N> rows\n"
+          "   -roi         Decode only the RAW data within the rectangle\n"
+          "   -bin         Decode the RAW data binned <N>x<N>\n"
+          "   -planar      Decode the RAW data into one area per color\n"
+          "   -release     Release the compressed image data once decoded\n"
+          "   -load-index  Load the TRUE restart index before decoding\n"
+          "   -save-index  Save the TRUE restart index after decoding\n"
+          "With -bands, -roi or -bin, the RAW data is checked against a\n"
+          "full decode, and a mismatch is an error\n",
           progname);
   exit(1);
 }
 
+typedef struct {
+  uint32_t rows;
+  uint32_t bands;
+  int bad;
+} band_count_t;
+
+static void count_band(void *ctx, uint32_t row, uint32_t rows)
+{
+  band_count_t *count = (band_count_t *)ctx;
+
+  if (row != count->rows) {
+    fprintf(stderr, "Band at row %u, expected %u\n", row, count->rows);
+    count->bad = 1;
+  }
+
+  count->rows = row + rows;
+  count->bands++;
+}
+
+/* One color of the RAW data, whatever the layout. In the Quattro
+   layout, the lower colors have half the resolution, i.e. shift 1. */
+
+typedef struct {
+  x3f_area16_t *area;
+  int channel;
+  int shift;
+} raw_plane_t;
+
+static int get_raw_planes(x3f_t *x3f, raw_plane_t *plane)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_image_data_t *ID;
+  x3f_area16_t *interleaved, *planes;
+  int quattro, color;
+
+  if (DE == NULL) return 0;
+
+  ID = &DE->header.data_subsection.image_data;
+  if (ID->tru != NULL) {
+    interleaved = &ID->tru->x3rgb16;
+    planes = ID->tru->plane16;
+  } else if (ID->huffman != NULL && ID->huffman->x3rgb16.data != NULL) {
+    interleaved = &ID->huffman->x3rgb16;
+    planes = ID->huffman->plane16;
+  } else if (ID->huffman != NULL && ID->planar) {
+    interleaved = NULL;
+    planes = ID->huffman->plane16;
+  } else
+    return 0;
+
+  quattro = ID->quattro != NULL && ID->quattro->quattro_layout;
+
+  for (color = 0; color < 3; color++) {
+    plane[color].area = ID->planar ? &planes[color] : interleaved;
+    plane[color].channel = ID->planar ? 0 : color;
+    plane[color].shift = quattro && color < 2;
+  }
+
+  if (quattro) {
+    plane[2].area = &ID->quattro->top16;
+    plane[2].channel = 0;
+  }
+
+  for (color = 0; color < 3; color++)
+    if (plane[color].area->data == NULL)
+      return 0;
+
+  return 1;
+}
+
+static uint16_t raw_value(raw_plane_t *plane, uint32_t row, uint32_t col)
+{
+  x3f_area16_t *area = plane->area;
+
+  return area->data[row*area->row_stride + col*area->channels +
+		    plane->channel];
+}
+
+/* FNV-1a of the values, color by color and row by row, so that it
+   does not depend on the layout */
+
+static uint32_t raw_checksum(raw_plane_t *plane)
+{
+  uint32_t sum = 2166136261u;
+  uint32_t row, col;
+  int color;
+
+  for (color = 0; color < 3; color++)
+    for (row = 0; row < plane[color].area->rows; row++)
+      for (col = 0; col < plane[color].area->columns; col++) {
+	uint16_t v = raw_value(&plane[color], row, col);
+
+	sum = (sum ^ (v & 0xff)) * 16777619u;
+	sum = (sum ^ (v >> 8)) * 16777619u;
+      }
+
+  return sum;
+}
+
+/* Check the RAW data in plane, decoded within rect, if not NULL, and
+   in bins of bin by bin pixels, if bin > 1, against the full decode
+   in full. Returns the number of mismatching values. */
+
+static uint32_t raw_compare(raw_plane_t *plane, raw_plane_t *full,
+			    uint32_t *rect, uint32_t bin)
+{
+  uint32_t bad = 0;
+  int color;
+
+  if (bin < 1) bin = 1;
+
+  for (color = 0; color < 3; color++) {
+    x3f_area16_t *A = plane[color].area, *F = full[color].area;
+    uint32_t left = 0, top = 0, right = F->columns - 1, bottom = F->rows - 1;
+    uint32_t columns, rows, row, col;
+
+    if (rect != NULL) {
+      int shift = full[color].shift;
+
+      left = rect[0] >> shift;
+      top = rect[1] >> shift;
+      if ((rect[2] >> shift) < right) right = rect[2] >> shift;
+      if ((rect[3] >> shift) < bottom) bottom = rect[3] >> shift;
+    }
+    columns = (right - left + bin)/bin;
+    rows = (bottom - top + bin)/bin;
+
+    if (A->columns != columns || A->rows != rows) {
+      fprintf(stderr, "Color %d is %ux%u, expected %ux%u\n",
+	      color, A->columns, A->rows, columns, rows);
+      return 1;
+    }
+
+    for (row = 0; row < rows; row++)
+      for (col = 0; col < columns; col++) {
+	uint32_t sum = 0, n = 0, r, c;
+
+	for (r = top + row*bin; r < top + (row + 1)*bin && r <= bottom; r++)
+	  for (c = left + col*bin; c < left + (col + 1)*bin && c <= right; c++) {
+	    sum += raw_value(&full[color], r, c);
+	    n++;
+	  }
+
+	if (raw_value(&plane[color], row, col) != (sum + n/2)/n) {
+	  if (bad == 0)
+	    fprintf(stderr, "Color %d differs at row %u column %u\n",
+		    color, row, col);
+	  bad++;
+	}
+      }
+  }
+
+  return bad;
+}
+
+/* Decode all of the RAW data of infilename anew and compare */
+
+static int raw_check(x3f_t *x3f, char *infilename,
+		     uint32_t *rect, uint32_t bin)
+{
+  raw_plane_t plane[3], full[3];
+  FILE *f_ref = fopen(infilename, "rb");
+  x3f_t *ref;
+  uint32_t bad;
+
+  if (f_ref == NULL) return 0;
+
+  ref = x3f_new_from_file(f_ref);
+  if (ref == NULL ||
+      x3f_load_data(ref, x3f_get_raw(ref)) != X3F_OK ||
+      !get_raw_planes(ref, full) || !get_raw_planes(x3f, plane))
+    bad = 1;
+  else
+    bad = raw_compare(plane, full, rect, bin);
+
+  if (ref != NULL) x3f_delete(ref);
+  fclose(f_ref);
+
+  return bad == 0;
+}
+
 int main(int argc, char *argv[])
 {
   FILE *f_in = NULL;
@@ -30,6 +224,12 @@ int main(int argc, char *argv[])
 
   int do_unpack_data = 0;
   int do_print_info = 1;
+  int from_memory = 0;
+  int band_rows = 0;
+  uint32_t roi[4], *rect = NULL;
+  uint32_t bin = 0;
+  char *load_index = NULL, *save_index = NULL;
+  int status = 0;
 
   char *infilename;
 
@@ -42,6 +242,29 @@ int main(int argc, char *argv[])
       do_unpack_data = 1;
     else if (!strcmp(argv[i], "-noprint"))
       do_print_info = 0;
+    else if (!strcmp(argv[i], "-stream"))
+      x3f_set_use_bulk_parse(0);
+    else if (!strcmp(argv[i], "-memory"))
+      from_memory = 1;
+    else if (!strcmp(argv[i], "-bands") && (i+1)<argc)
+      band_rows = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-roi") && (i+4)<argc) {
+      int j;
+
+      for (j=0; j<4; j++)
+	roi[j] = atoi(argv[++i]);
+      rect = roi;
+    }
+    else if (!strcmp(argv[i], "-bin") && (i+1)<argc)
+      bin = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-planar"))
+      x3f_set_use_planar(1);
+    else if (!strcmp(argv[i], "-release"))
+      x3f_set_release_data(1);
+    else if (!strcmp(argv[i], "-load-index") && (i+1)<argc)
+      load_index = argv[++i];
+    else if (!strcmp(argv[i], "-save-index") && (i+1)<argc)
+      save_index = argv[++i];
     else
       break;			/* Now comes the file name */
 
@@ -57,8 +280,24 @@ int main(int argc, char *argv[])
     return 1;
   }
 
-  printf("READ THE X3F FILE %s\n", argv[1]);
-  x3f = x3f_new_from_file(f_in);
+  printf("READ THE X3F FILE %s\n", infilename);
+  if (from_memory) {
+    long size;
+    void *data;
+
+    fseek(f_in, 0, SEEK_END);
+    size = ftell(f_in);
+    fseek(f_in, 0, SEEK_SET);
+
+    data = malloc(size);
+    if (data == NULL || fread(data, 1, size, f_in) != size) {
+      fprintf(stderr, "Could not read infile %s\n", infilename);
+      return 1;
+    }
+
+    x3f = x3f_new_from_memory(data, size, free);
+  } else
+    x3f = x3f_new_from_file(f_in);
 
   if (do_print_info) {
     printf("PRINT THE SKELETON X3F STRUCTURE\n");
@@ -66,8 +305,56 @@ int main(int argc, char *argv[])
   }
 
   if (do_unpack_data) {
+    x3f_return_t ret;
+    raw_plane_t plane[3];
+    int check = band_rows > 0 || rect != NULL || bin > 1;
+
+    if (load_index != NULL &&
+	(ret = x3f_load_true_index(x3f, load_index)) != X3F_OK) {
+      fprintf(stderr, "Could not load index %s: %s\n",
+	      load_index, x3f_err(ret));
+      status = 1;
+    }
+
     printf("LOAD RAW DATA\n");
-    x3f_load_data(x3f, x3f_get_raw(x3f));
+    if (band_rows > 0) {
+      band_count_t count = {0, 0, 0};
+
+      ret = x3f_load_data_banded(x3f, x3f_get_raw(x3f), rect, bin, band_rows,
+				 count_band, &count);
+      if (ret == X3F_OK)
+	printf("DECODED %u ROWS IN %u BANDS\n", count.rows, count.bands);
+      if (count.bad)
+	status = 1;
+    } else if (rect != NULL)
+      ret = x3f_load_data_roi(x3f, x3f_get_raw(x3f), rect);
+    else if (bin > 1)
+      ret = x3f_load_data_binned(x3f, x3f_get_raw(x3f), bin);
+    else
+      ret = x3f_load_data(x3f, x3f_get_raw(x3f));
+
+    if (ret != X3F_OK) {
+      fprintf(stderr, "Could not load RAW data: %s\n", x3f_err(ret));
+      if (check)
+	status = 1;
+    } else if (get_raw_planes(x3f, plane))
+      printf("RAW DATA CHECKSUM %08x\n", raw_checksum(plane));
+
+    if (check && ret == X3F_OK) {
+      if (raw_check(x3f, infilename, rect, bin))
+	printf("RAW DATA MATCHES A FULL DECODE\n");
+      else {
+	printf("RAW DATA DOES NOT MATCH A FULL DECODE\n");
+	status = 1;
+      }
+    }
+
+    if (save_index != NULL &&
+	(ret = x3f_save_true_index(x3f, save_index)) != X3F_OK) {
+      fprintf(stderr, "Could not save index %s: %s\n",
+	      save_index, x3f_err(ret));
+      status = 1;
+    }
 
     printf("LOAD THUMBNAIL DATA\n");
     x3f_load_data(x3f, x3f_get_thumb_plain(x3f));
@@ -88,6 +375,18 @@ int main(int argc, char *argv[])
       printf("PRINT THE UNPACKED X3F STRUCTURE\n");
       x3f_print_meta(x3f);
     }
+
+    printf("MEMORY HELD\n");
+    for (i=0; i<x3f->directory_section.num_directory_entries; i++) {
+      x3f_directory_entry_t *DE = &x3f->directory_section.directory_entry[i];
+      x3f_memory_t mem;
+
+      x3f_get_memory(x3f, DE, &mem);
+      printf("  %08x data %lu mapped %lu decoded %lu tables %lu\n",
+	     DE->header.identifier,
+	     (unsigned long)mem.data, (unsigned long)mem.mapped,
+	     (unsigned long)mem.decoded, (unsigned long)mem.tables);
+    }
   }
 
   printf("CLEAN UP\n");
@@ -95,5 +394,5 @@ int main(int argc, char *argv[])
 
   fclose(f_in);
 
-  return 0;
+  return status;
 }
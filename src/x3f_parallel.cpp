@@ -0,0 +1,105 @@
+/* X3F_PARALLEL.CPP
+ *
+ * Library for running parts of the X3F decoding in parallel.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include <tbb/blocked_range.h>
+#include <tbb/global_control.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "x3f_parallel.h"
+#include "x3f_printf.h"
+
+static int max_threads = 0;
+
+/* NULL when using the TBB defaults, i.e. all cores */
+static tbb::global_control *control = NULL;
+static tbb::task_arena *arena = NULL;
+
+void x3f_set_max_threads(int threads)
+{
+  if (threads < 0) threads = 0;
+
+  max_threads = threads;
+
+  delete arena;
+  arena = NULL;
+  delete control;
+  control = NULL;
+
+  /* The global control is needed to go beyond the number of cores */
+  if (threads > 1) {
+    control =
+      new tbb::global_control(tbb::global_control::max_allowed_parallelism,
+			      threads);
+    arena = new tbb::task_arena(threads);
+  }
+
+  x3f_printf(DEBUG, "Max threads: %d (0 = automatic)\n", threads);
+}
+
+int x3f_get_max_threads(void)
+{
+  return max_threads;
+}
+
+void x3f_parallel_for(int n, x3f_parallel_func_t func, void *ctx)
+{
+  if (n <= 0) return;
+
+  if (max_threads == 1 || n == 1) {
+    for (int i = 0; i < n; i++) func(ctx, i);
+    return;
+  }
+
+  /* Each index is a task of its own, the caller decides the grain */
+  auto loop = [=] {
+    tbb::parallel_for(tbb::blocked_range<int>(0, n, 1),
+		      [=](const tbb::blocked_range<int> &r) {
+			for (int i = r.begin(); i != r.end(); i++)
+			  func(ctx, i);
+		      });
+  };
+
+  if (arena)
+    arena->execute(loop);
+  else
+    loop();
+}
+
+static std::mutex lock;
+
+void x3f_parallel_lock(void)
+{
+  lock.lock();
+}
+
+void x3f_parallel_unlock(void)
+{
+  lock.unlock();
+}
+
+/* The pointers live in plain C structures, so they are accessed as
+   atomics in place */
+static_assert(sizeof(std::atomic<void *>) == sizeof(void *),
+	      "Atomic pointers must be plain pointers");
+
+void x3f_parallel_publish(void **p, void *value)
+{
+  reinterpret_cast<std::atomic<void *> *>(p)->
+    store(value, std::memory_order_release);
+}
+
+void *x3f_parallel_published(void **p)
+{
+  return reinterpret_cast<std::atomic<void *> *>(p)->
+    load(std::memory_order_acquire);
+}
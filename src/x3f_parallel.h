@@ -0,0 +1,43 @@
+/* X3F_PARALLEL.H
+ *
+ * Library for running parts of the X3F decoding in parallel.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_PARALLEL_H
+#define X3F_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*x3f_parallel_func_t)(void *ctx, int index);
+
+/* Run func(ctx, index) for all 0 <= index < n, possibly in
+   parallel. Returns when all of them are ready. */
+extern void x3f_parallel_for(int n, x3f_parallel_func_t func, void *ctx);
+
+/* Max number of threads used by x3f_parallel_for. 0 means as many
+   as there are cores, 1 means no threading at all. */
+extern void x3f_set_max_threads(int threads);
+extern int x3f_get_max_threads(void);
+
+/* One process wide lock, for short critical sections around data
+   shared between threads, e.g. caches. Not recursive. */
+extern void x3f_parallel_lock(void);
+extern void x3f_parallel_unlock(void);
+
+/* Pointers that are set once, under the lock, and then read without
+   it. What a published pointer points to is complete when the pointer
+   is read. */
+extern void x3f_parallel_publish(void **p, void *value);
+extern void *x3f_parallel_published(void **p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
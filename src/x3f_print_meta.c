@@ -48,17 +48,18 @@ static char *id_to_str(uint32_t id)
   return buf;
 }
 
-static void print_matrix_element(FILE *f_out, camf_entry_t *entry, uint32_t i)
+static void print_matrix_element(FILE *f_out, camf_entry_t *entry,
+				 void *decoded, uint32_t i)
 {
   switch (entry->matrix_decoded_type) {
   case M_FLOAT:
-    fprintf(f_out, "%12g ", ((double *)(entry->matrix_decoded))[i]);
+    fprintf(f_out, "%12g ", ((double *)decoded)[i]);
     break;
   case M_INT:
-    fprintf(f_out, "%12d ", ((int32_t *)(entry->matrix_decoded))[i]);
+    fprintf(f_out, "%12d ", ((int32_t *)decoded)[i]);
     break;
   case M_UINT:
-    fprintf(f_out, "%12d ", ((uint32_t *)(entry->matrix_decoded))[i]);
+    fprintf(f_out, "%12d ", ((uint32_t *)decoded)[i]);
     break;
   }
 }
@@ -69,6 +70,7 @@ static void print_matrix(FILE *f_out, camf_entry_t *entry)
   uint32_t linesize = entry->matrix_dim_entry[dim-1].size;
   uint32_t blocksize = (uint32_t)(-1);
   uint32_t totalsize = entry->matrix_elements;
+  void *decoded = x3f_get_camf_matrix_decoded(entry);
   int i;
 
   switch (entry->matrix_decoded_type) {
@@ -110,8 +112,13 @@ static void print_matrix(FILE *f_out, camf_entry_t *entry)
     fprintf(stderr, "Not support for higher than 3D in printout\n");
   }
 
+  if (decoded == NULL) {
+    fprintf(f_out, "Could not get the matrix\n");
+    return;
+  }
+
   for (i=0; i<totalsize; i++) {
-    print_matrix_element(f_out, entry, i);
+    print_matrix_element(f_out, entry, decoded, i);
     if ((i+1)%linesize == 0) fprintf(f_out, "\n");
     if ((i+1)%blocksize == 0) fprintf(f_out, "\n");
     if (i >= (max_printed_matrix_elements-1)) {
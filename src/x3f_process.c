@@ -56,8 +56,23 @@ static int sum_area_sqdev(x3f_area16_t area, int colors, double *mean,
   return area.columns*area.rows;
 }
 
+/* The same part of another plane, as all planes share one layout */
+
+static x3f_area16_t plane_area(x3f_area16_t *planes, x3f_area16_t area,
+			       int color)
+{
+  area.data = planes[color].data + (area.data - planes[0].data);
+
+  return area;
+}
+
+/* If planar, image is colors planes, else one image with at least
+   colors channels. The shield areas are looked up once in either
+   case. */
+
 static int get_black_level(x3f_t *x3f,
-			   x3f_area16_t *image, int rescale, int colors,
+			   x3f_area16_t *image, int planar,
+			   int rescale, int colors,
 			   double *black_level, double *black_dev)
 {
   uint64_t *black, *black_sum;
@@ -76,7 +91,7 @@ static int get_black_level(x3f_t *x3f,
   int use[4] = {1, 1, 1, 1};
   x3f_area16_t area[4];
 
-  if (image->channels < colors) return 0;
+  if (!planar && image->channels < colors) return 0;
 
 #define BOTTOM 1
 #define RIGHT 3
@@ -135,7 +150,14 @@ static int get_black_level(x3f_t *x3f,
   for (i=0; i<4; i++)
     if (use[i]) {
       int color;
-      int pixels = sum_area(area[i], colors, black);
+      int pixels = 0;
+
+      if (planar)
+	for (color = 0; color < colors; color++)
+	  pixels = sum_area(plane_area(image, area[i], color), 1,
+			    &black[color]);
+      else
+	pixels = sum_area(area[i], colors, black);
 
       pixels_sum += pixels;
 
@@ -162,7 +184,14 @@ static int get_black_level(x3f_t *x3f,
   for (i=0; i<4; i++)
     if (use[i]) {
       int color;
-      int pixels = sum_area_sqdev(area[i], colors, black_level, black_sqdev);
+      int pixels = 0;
+
+      if (planar)
+	for (color = 0; color < colors; color++)
+	  pixels = sum_area_sqdev(plane_area(image, area[i], color), 1,
+				  &black_level[color], &black_sqdev[color]);
+      else
+	pixels = sum_area_sqdev(area[i], colors, black_level, black_sqdev);
 
       pixels_sum += pixels;
 
@@ -376,6 +405,9 @@ typedef struct {
       ~(1 << (_PN((_c), (_r), (_cs)) & 0x1f));				\
   } while (0)
 
+/* image is one area per color, e.g. from x3f_image_channels() or
+   planes, that all have the same layout */
+
 static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
 {
   bad_pixel_t *bad_pixel_list = NULL;
@@ -501,24 +533,22 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
 
     /* Iterate over all pixels in the bad pixel list, in this pass */
     for (p=bad_pixel_list; p && (pn=p->next, 1); p=pn) {
-      uint16_t *outp =
-	&image->data[p->r*image->row_stride + p->c*image->channels];
-      uint16_t *inp[4] = {NULL, NULL, NULL, NULL};
+      /* Offsets of the pixel and its neighbors, the same for all
+	 colors */
+      uint32_t outp = p->r*image->row_stride + p->c*image->channels;
+      uint32_t in[4];
+      int inp[4] = {0, 0, 0, 0};
       int num = 0;
 
       /* Collect status of neighbor pixels */
       if (!TEST_PIX(bad_pixel_vec, p->c - 1, p->r, image->columns, image->rows))
-	num++, inp[0] =
-	  &image->data[p->r*image->row_stride + (p->c - 1)*image->channels];
+	num++, inp[0] = 1, in[0] = outp - image->channels;
       if (!TEST_PIX(bad_pixel_vec, p->c + 1, p->r, image->columns, image->rows))
-	num++, inp[1] =
-	  &image->data[p->r*image->row_stride + (p->c + 1)*image->channels];
+	num++, inp[1] = 1, in[1] = outp + image->channels;
       if (!TEST_PIX(bad_pixel_vec, p->c, p->r - 1, image->columns, image->rows))
-	num++, inp[2] =
-	  &image->data[(p->r - 1)*image->row_stride + p->c*image->channels];
+	num++, inp[2] = 1, in[2] = outp - image->row_stride;
       if (!TEST_PIX(bad_pixel_vec, p->c, p->r + 1, image->columns, image->rows))
-	num++, inp[3] =
-	  &image->data[(p->r + 1)*image->row_stride + p->c*image->channels];
+	num++, inp[3] = 1, in[3] = outp + image->row_stride;
 
       /* Test if interpolation is possible ... */
       if (inp[0] && inp[1] && inp[2] && inp[3])
@@ -526,10 +556,10 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
 	stats.all_four++;
       else if (inp[0] && inp[1])
 	/* ... left and right are OK */
-	inp[2] = inp[3] = NULL, num = 2, stats.two_linear++;
+	inp[2] = inp[3] = 0, num = 2, stats.two_linear++;
       else if (inp[2] && inp[3])
 	/* ... above and under are OK */
-	inp[0] = inp[1] = NULL, num = 2, stats.two_linear++;
+	inp[0] = inp[1] = 0, num = 2, stats.two_linear++;
       else if (fix_corner && num == 2)
 	/* ... corner (plus nothing else to do) are OK */
 	stats.two_corner++;
@@ -542,8 +572,8 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
       for (color=0; color < colors; color++) {
 	uint32_t sum = 0;
 	for (i=0; i<4; i++)
-	  if (inp[i]) sum += inp[i][color];
-	outp[color] = (sum + num/2)/num;
+	  if (inp[i]) sum += image[color].data[in[i]];
+	image[color].data[outp] = (sum + num/2)/num;
       }
 
       /* Remove p from bad_pixel_list */
@@ -590,24 +620,32 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
   free(bad_pixel_vec);
 }
 
+/* Works on the RAW image in either layout. The values are scaled one
+   color at a time, so that the loops are unit stride for planes. */
+
 static int preprocess_data(x3f_t *x3f, int fix_bad, char *wb, x3f_image_levels_t *ilevels)
 {
-  x3f_area16_t image, qtop;
+  x3f_area16_t image, qtop, chan[3];
   int row, col, color;
   uint32_t max_raw[3];
   double scale[3], black_level[3], black_dev[3], intermediate_bias;
   int quattro = x3f_image_area_qtop(x3f, &qtop);
   int colors_in = quattro ? 2 : 3;
+  int planar = x3f_image_planes(x3f, chan);
     double digital_ISO_Gain[3];
     int i;
 
-  if (!x3f_image_area(x3f, &image) || image.channels < 3) return 0;
+  if (planar)
+    image = chan[0];
+  else if (!x3f_image_area(x3f, &image) || image.channels < 3) return 0;
+  else x3f_image_channels(&image, chan);
   if (quattro && (qtop.channels < 1 ||
 		  qtop.rows < 2*image.rows || qtop.columns < 2*image.columns))
     return 0;
 
-  if (!get_black_level(x3f, &image, 1, colors_in, black_level, black_dev) ||
-      (quattro && !get_black_level(x3f, &qtop, 0, 1,
+  if (!get_black_level(x3f, planar ? chan : &image, planar, 1, colors_in,
+		       black_level, black_dev) ||
+      (quattro && !get_black_level(x3f, &qtop, 0, 0, 1,
 				   &black_level[2], &black_dev[2]))) {
     x3f_printf(ERR, "Could not get black level\n");
     return 0;
@@ -651,12 +689,13 @@ static int preprocess_data(x3f_t *x3f, int fix_bad, char *wb, x3f_image_levels_t
         scale[color] = ((ilevels->white[color] - ilevels->black[color]) / (max_raw[color] - black_level[color])) * digital_ISO_Gain[color]; 
     }
 
-  /* Preprocess image data (HUF/TRU->x3rgb16) */
+  /* Preprocess image data (HUF/TRU->x3rgb16 or plane16) */
   for (row = 0; row < image.rows; row++)
-    for (col = 0; col < image.columns; col++)
-      for (color = 0; color < colors_in; color++) {
-	uint16_t *valp =
-	  &image.data[image.row_stride*row + image.channels*col + color];
+    for (color = 0; color < colors_in; color++) {
+      uint16_t *rowp = &chan[color].data[chan[color].row_stride*row];
+
+      for (col = 0; col < image.columns; col++) {
+	uint16_t *valp = &rowp[chan[color].channels*col];
 	int32_t out =
 	  (int32_t)round(scale[color] * (*valp - black_level[color]) +
 			 ilevels->black[color]);
@@ -665,13 +704,14 @@ static int preprocess_data(x3f_t *x3f, int fix_bad, char *wb, x3f_image_levels_t
 	else if (out > 65535) *valp = 65535;
 	else *valp = out;
       }
+    }
 
   if (quattro) {
     /* Preprocess and downsample Quattro top layer (Q->top16) */
     for (row = 0; row < image.rows; row++)
       for (col = 0; col < image.columns; col++) {
 	uint16_t *outp =
-	  &image.data[image.row_stride*row + image.channels*col + 2];
+	  &chan[2].data[chan[2].row_stride*row + chan[2].channels*col];
 	uint16_t *row1 =
 	  &qtop.data[qtop.row_stride*2*row + qtop.channels*2*col];
 	uint16_t *row2 =
@@ -700,7 +740,7 @@ static int preprocess_data(x3f_t *x3f, int fix_bad, char *wb, x3f_image_levels_t
     if (fix_bad) interpolate_bad_pixels(x3f, &qtop, 1);
   }
 
-  if (fix_bad) interpolate_bad_pixels(x3f, &image, 3);
+  if (fix_bad) interpolate_bad_pixels(x3f, chan, 3);
 
   return 1;
 }
@@ -767,7 +807,8 @@ static int get_conv(x3f_t *x3f, x3f_color_encoding_t encoding, char *wb,
   return 1;
 }
 
-/* Converts the data in place */
+/* Converts the data in place. image is one area per color, as for
+   interpolate_bad_pixels. */
 
 #define LUTSIZE 1024
 
@@ -785,8 +826,6 @@ static int convert_data(x3f_t *x3f,
   x3f_spatial_gain_corr_t sgain[MAXCORR];
   int sgain_num;
 
-  if (image->channels < 3) return 0;
-
   if (!get_conv(x3f, encoding, wb, LUTSIZE, max_out, lut, conv_matrix))
     return 0;
 
@@ -805,8 +844,8 @@ static int convert_data(x3f_t *x3f,
 
       /* Get the data */
       for (color = 0; color < 3; color++) {
-	valp[color] =
-	  &image->data[image->row_stride*row + image->channels*col + color];
+	valp[color] = &image[color].data[image[color].row_stride*row +
+					 image[color].channels*col];
 	input[color] = x3f_calc_spatial_gain(sgain, sgain_num,
 					     row, col, color,
 					     image->rows, image->columns) *
@@ -899,8 +938,10 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
 			       int apply_sgain,
 			       char *wb)
 {
-  x3f_area16_t original_image, expanded;
+  x3f_area16_t original_image, expanded, chan[3];
   x3f_image_levels_t il;
+  int planar = x3f_image_planes(x3f, chan);
+  int converted = 0;
 
   if (wb == NULL) wb = x3f_get_wb(x3f);
 
@@ -914,6 +955,24 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
     return ilevels == NULL;
   }
 
+  /* A planar image is preprocessed, and converted if nothing else
+     needs it interleaved, before it is interleaved for the output */
+  if (planar) {
+    x3f_area16_t qtop;
+
+    if (encoding != UNPROCESSED) {
+      if (!preprocess_data(x3f, fix_bad, wb, &il)) return 0;
+
+      if (encoding != NONE && !denoise && !x3f_image_area_qtop(x3f, &qtop)) {
+	if (!convert_data(x3f, chan, &il, encoding, apply_sgain, wb))
+	  return 0;
+	converted = 1;
+      }
+    }
+
+    if (!x3f_image_interleave(x3f)) return 0;
+  }
+
   if (!x3f_image_area(x3f, &original_image)) return 0;
   if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &original_image, 1,
 				   image))
@@ -921,7 +980,7 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
 
   if (encoding == UNPROCESSED) return ilevels == NULL;
 
-  if (!preprocess_data(x3f, fix_bad, wb, &il)) return 0;
+  if (!planar && !preprocess_data(x3f, fix_bad, wb, &il)) return 0;
 
   if (expand_quattro(x3f, denoise, &expanded)) {
     /* NOTE: expand_quattro destroys the data of original_image */
@@ -932,10 +991,13 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
   }
   else if (denoise && !run_denoising(x3f)) return 0;
 
-  if (encoding != NONE &&
-      !convert_data(x3f, &original_image, &il, encoding, apply_sgain, wb)) {
-    free(image->buf);
-    return 0;
+  if (encoding != NONE && !converted) {
+    x3f_image_channels(&original_image, chan);
+    if (original_image.channels < 3 ||
+	!convert_data(x3f, chan, &il, encoding, apply_sgain, wb)) {
+      free(image->buf);
+      return 0;
+    }
   }
 
   if (ilevels) *ilevels = il;